@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the map decisions of the dust target.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dm_dust
+
+#if !defined(_DM_DUST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DM_DUST_TRACE_H
+
+#include <linux/blkdev.h>
+#include <linux/tracepoint.h>
+
+#ifndef _DM_DUST_DECISION
+#define _DM_DUST_DECISION
+enum dust_decision {
+	DUST_REMAP,
+	DUST_KILL,
+	DUST_HEAL,
+	DUST_CONSUME,
+	DUST_DELAY,
+};
+#endif
+
+TRACE_DEFINE_ENUM(DUST_REMAP);
+TRACE_DEFINE_ENUM(DUST_KILL);
+TRACE_DEFINE_ENUM(DUST_HEAL);
+TRACE_DEFINE_ENUM(DUST_CONSUME);
+TRACE_DEFINE_ENUM(DUST_DELAY);
+
+#define show_dust_decision(d)					\
+	__print_symbolic(d,					\
+			 { DUST_REMAP,		"REMAPPED" },	\
+			 { DUST_KILL,		"KILL" },	\
+			 { DUST_HEAL,		"HEAL" },	\
+			 { DUST_CONSUME,	"CONSUME" },	\
+			 { DUST_DELAY,		"DELAY" })
+
+/*
+ * The outcome of dust_map(), after the bio was trimmed to the part that
+ * is remapped, failed or delayed.
+ */
+TRACE_EVENT(dust_map,
+
+	TP_PROTO(struct bio *bio, int decision),
+
+	TP_ARGS(bio, decision),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	nr_sector)
+		__field(bool,		write)
+		__field(int,		decision)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= bio_dev(bio);
+		__entry->sector		= bio->bi_iter.bi_sector;
+		__entry->nr_sector	= bio_sectors(bio);
+		__entry->write		= op_is_write(bio_op(bio));
+		__entry->decision	= decision;
+	),
+
+	TP_printk("%d,%d %s %llu + %u %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->write ? "write" : "read",
+		  (unsigned long long)__entry->sector, __entry->nr_sector,
+		  show_dust_decision(__entry->decision))
+);
+
+/*
+ * The decision on the blocks [first, last] of a bio that was checked
+ * against the bad block list, and the number of extents, or of array
+ * entries, the lookup visited.
+ */
+DECLARE_EVENT_CLASS(dust_map_blocks,
+
+	TP_PROTO(struct bio *bio, sector_t first, sector_t last, int decision,
+		 unsigned int depth),
+
+	TP_ARGS(bio, first, last, decision, depth),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(sector_t,	first)
+		__field(sector_t,	last)
+		__field(int,		decision)
+		__field(unsigned int,	depth)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= bio_dev(bio);
+		__entry->sector		= bio->bi_iter.bi_sector;
+		__entry->first		= first;
+		__entry->last		= last;
+		__entry->decision	= decision;
+		__entry->depth		= depth;
+	),
+
+	TP_printk("%d,%d sector %llu blocks %llu-%llu %s depth %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->first,
+		  (unsigned long long)__entry->last,
+		  show_dust_decision(__entry->decision), __entry->depth)
+);
+
+DEFINE_EVENT(dust_map_blocks, dust_map_read,
+
+	TP_PROTO(struct bio *bio, sector_t first, sector_t last, int decision,
+		 unsigned int depth),
+
+	TP_ARGS(bio, first, last, decision, depth)
+);
+
+DEFINE_EVENT(dust_map_blocks, dust_map_write,
+
+	TP_PROTO(struct bio *bio, sector_t first, sector_t last, int decision,
+		 unsigned int depth),
+
+	TP_ARGS(bio, first, last, decision, depth)
+);
+
+#endif /* _DM_DUST_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dm-dust-trace
+
+#include <trace/define_trace.h>
@@ -24,471 +24,6002 @@
  *
  */
 
+#include <linux/badblocks.h>
+#include <linux/cpu.h>
+#include <linux/crc32c.h>
 #include <linux/device-mapper.h>
+#include <linux/dm-io.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/jump_label.h>
+#include <linux/math64.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
+#include <linux/ratelimit.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "dm-dust-trace.h"
 
 #define DM_MSG_PREFIX "dust"
 
 #define RD false
 #define WR true
 
+/*
+ * A block may be bad for reads, for writes or for both, it may be slow,
+ * and reads of it may return corrupted data; one extent in the bad block
+ * list carries all of these states.
+ */
+#define DUST_BB_READ	0x1
+#define DUST_BB_WRITE	0x2
+#define DUST_BB_SLOW	0x4
+#define DUST_BB_CORRUPT	0x8
+#define DUST_BB_ALL	(DUST_BB_READ | DUST_BB_WRITE | DUST_BB_SLOW | \
+			 DUST_BB_CORRUPT)
+
+/*
+ * An extent of len blocks starting at block bb that share the same
+ * failure modes.  wr_fail_cnt applies to every block of the extent
+ * separately: a write that consumes one block's failure splits that
+ * block off first.  Once a block is an extent of its own, the map path
+ * consumes its failures with an atomic decrement and no lock, and only
+ * the write that finds the count at zero takes the lock to heal it.
+ * delay_us is the latency added to bios touching a slow extent.  Extents
+ * never overlap, and neighbours with equal state are merged unless they
+ * have write failures left.
+ */
 struct badblock {
 	struct rb_node node;
+	struct rcu_head rcu;
 	sector_t bb;
-	unsigned char wr_fail_cnt;
+	sector_t len;
+	unsigned char flags;
+	atomic_t wr_fail_cnt;
+	unsigned int delay_us;
 };
 
-struct dust_device {
-	struct dm_dev *dev;
-	struct rb_root badblocklist_read;
-	struct rb_root badblocklist_write;
+#define DUST_MAX_WR_FAIL_CNT	INT_MAX
+
+/*
+ * Per-CPU I/O and fault injection counters, summed up when reported.
+ */
+struct dust_stats {
+	u64 reads_passed;
+	u64 reads_failed;
+	u64 writes_passed;
+	u64 writes_failed;
+	u64 bb_hits;
+	u64 blocks_healed;
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 bios_delayed;
+	u64 blocks_corrupted;
+};
+
+/*
+ * Per-CPU histograms of the time from dust_map() to completion, recorded
+ * while enabled, with log2 buckets in ns.  A bio that took ns lands in
+ * bucket fls64(ns), the last bucket taking everything from 2^38 ns on.
+ * Bios are told apart by whether they passed without touching a bad
+ * extent, passed although they overlap one, or were failed.
+ */
+enum dust_lat_kind {
+	DUST_LAT_PASS,
+	DUST_LAT_HIT,
+	DUST_LAT_FAIL,
+	DUST_LAT_NR,
+};
+
+#define DUST_LAT_BUCKETS 40
+
+struct dust_lat {
+	u64 n[2][DUST_LAT_NR][DUST_LAT_BUCKETS];
+};
+
+/*
+ * Fault events: a bio failed, blocks healed by a write, blocks added to
+ * or removed from the list.  arg is the write fail count of an add, or
+ * the delay of a slow range.
+ */
+enum dust_event_type {
+	DUST_EV_KILL,
+	DUST_EV_HEAL,
+	DUST_EV_ADD,
+	DUST_EV_REMOVE,
+};
+
+struct dust_event {
+	u64 time_ns;
+	u64 first;
+	u64 last;
+	u32 arg;
+	u8 type;
+	u8 flag;
+};
+
+#define DUST_EVENTS 256
+
+/*
+ * Each CPU records its events in a ring of its own, so the map path
+ * takes no shared lock and touches no shared cache line.  head counts
+ * the events ever recorded and tail the ones the events message has
+ * read; the seqcount lets the reader copy an entry the CPU is not
+ * overwriting at the same time.
+ */
+struct dust_event_ring {
+	seqcount_t seq;
+	unsigned long head;
+	unsigned long tail;
+	struct dust_event ev[DUST_EVENTS];
+};
+
+/*
+ * Delayed bios wait on the queue of the CPU that mapped them, sorted by
+ * expiry.  One hrtimer per queue fires for the earliest bio and kicks
+ * the work that resubmits whatever has expired, so any number of bios in
+ * flight is handled without a context of its own.
+ */
+struct dust_delay_queue {
+	struct dust_device *dd;
+	spinlock_t lock;
+	struct list_head bios;
+	struct hrtimer timer;
+	struct work_struct work;
+};
+
+/*
+ * Per-bio data, the link of a delayed bio into its queue, and for a read
+ * that covers corrupt blocks the extent of the bio, which is used up by
+ * the time it completes.  start_ns is when a bio timed for the latency
+ * histograms was mapped, or 0.
+ */
+struct dust_bio {
+	struct list_head list;
+	ktime_t expires;
+	struct bvec_iter iter;
+	bool corrupt;
+	u8 lat_kind;
+	u64 start_ns;
+};
+
+/*
+ * Upper bound of the per-range delay and of the global delay and jitter.
+ */
+#define DUST_DELAY_MAX_US (10 * USEC_PER_SEC)
+
+/*
+ * Random failures of one direction, on top of the bad block list.  A
+ * block fails with probability threshold / 2^32.  By default the
+ * decision is a hash of the seed and the block number, so the same
+ * blocks fail on every run and no extent is needed for them.  per_io
+ * draws from a per-CPU generator for every bio instead, for failures
+ * that come and go.
+ */
+struct dust_rate {
+	u64 threshold;
+	bool per_io;
+};
+
+/*
+ * One bit per chunk of 2^shift blocks, set while an extent may overlap
+ * the chunk.  The map path checks it before walking the tree, so bios
+ * to healthy areas cost a cache line or two.  Chunks grow with the
+ * device so the bitmap stays within DUST_FILTER_MAX_BITS.  Bits are set
+ * and cleared with the lock of their shard held.
+ */
+struct dust_filter {
+	unsigned long *bits;
+	unsigned long nr;
+	int shift;
+};
+
+#define DUST_FILTER_MAX_BITS (1UL << 20)
+
+/*
+ * The map path looks extents up in the tree, or, with the array index,
+ * in a sorted array of extent start blocks built from the tree in the
+ * background, one per shard.  The array is tagged with the dust_seq
+ * value it was built at and only used while the tree has not changed
+ * since; until it is rebuilt, lookups go to the tree.  That suits fault
+ * maps that are loaded once and then looked up for every bio.
+ *
+ * Each array entry carries a copy of the length and flags of its extent,
+ * which cannot change without changing dust_seq, and every NUMA node gets
+ * a replica of the array in its own memory.  A lookup that finds nothing
+ * only reads memory local to the submitting CPU, apart from dust_seq.
+ */
+enum dust_index {
+	DUST_INDEX_RBTREE,
+	DUST_INDEX_ARRAY,
+};
+
+struct dust_array_ent {
+	struct badblock *bblk;
+	sector_t len;
+	unsigned char flags;
+};
+
+struct dust_array {
+	struct rcu_head rcu;
+	unsigned int seq;
+	unsigned long nr;
+	struct dust_array_ent *ents;
+	sector_t keys[];
+};
+
+/*
+ * Rebuilds wait this long so that a burst of updates pays for one.
+ */
+#define DUST_INDEX_DELAY (HZ / 10)
+
+/*
+ * The block space is split into regions of 2^shard_shift blocks, the
+ * last one open ended, and each region has a bad block list of its own:
+ * tree, array index replicas indexed by node, counters, lock and
+ * sequence count.  Extents never cross a region boundary, so writes that
+ * heal blocks in different regions never contend.  The regions are
+ * aligned to whole words of the filter bitmap, so no two shards ever
+ * modify the same word.
+ */
+struct dust_shard {
+	struct dust_bblist *bbl;
+	struct rb_root badblocklist;
+	struct dust_array __rcu **array;
+	struct delayed_work index_work;
 	unsigned long long badblock_count_read;
 	unsigned long long badblock_count_write;
+	unsigned long long badblock_count_slow;
+	unsigned long long badblock_count_corrupt;
 	spinlock_t dust_lock;
+	seqcount_t dust_seq;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * The bad block list of one or more targets: its shards, filter and
+ * lookup index.  Blocks are numbered on the underlying device, so
+ * targets over different parts of the same device can share a list by
+ * giving it a name; the list is referenced by each of them and goes away
+ * with the last.  ref and the list of named lists are protected by
+ * dust_bblist_lock.
+ *
+ * pubs lists the targets that publish the list to their disk, under
+ * pub_lock, which nests inside dust_lock.  nr_pubs counts them, so that
+ * changes to a list nobody publishes need not take pub_lock.
+ *
+ * snaps holds named copies of the list to restore it from later, each a
+ * sorted array of extents in the checkpoint format, which takes less
+ * than half the memory of the tree.  A copy that has been restored also
+ * keeps spare trees built from the array, so that the next restore only
+ * swaps roots; the work builds them again in the background after each
+ * restore.  snap_lock protects the copies and serializes taking and
+ * restoring them.
+ */
+#define DUST_NAME_LEN 32
+#define DUST_MAX_SNAPS 64
+
+struct dust_snap {
+	struct list_head list;
+	struct dust_bblist *bbl;
+	char name[DUST_NAME_LEN];
+	struct dust_md_extent *ext;
+	unsigned long nr;
+	struct dust_build *spare;
+	struct work_struct work;
+};
+
+struct dust_bblist {
+	struct list_head list;
+	char name[DUST_NAME_LEN];
+	unsigned int ref;
+	struct block_device *bdev;
+	unsigned int blksz;
+	struct dust_shard *shards;
+	unsigned int nr_shards;
+	int shard_shift;
+	enum dust_index index;
+	struct dust_filter filter;
+	spinlock_t pub_lock;
+	struct list_head pubs;
+	unsigned int nr_pubs;
+	struct mutex snap_lock;
+	struct list_head snaps;
+	unsigned int nr_snaps;
+};
+
+#define DUST_MAX_SHARDS 1024
+
+/*
+ * Optional metadata device that keeps the bad block list across table
+ * loads.  Layout, in 512 byte sectors:
+ *
+ *   0                       superblock
+ *   DUST_MD_JOURNAL_START   journal of DUST_MD_JOURNAL_SECTORS
+ *   DUST_MD_CKPT_START      two checkpoint slots of equal size
+ *
+ * A checkpoint is the sorted extent list.  The superblock names the slot
+ * with the current one, its checksum and the generation.  Every update
+ * from a message is appended to the journal, tagged with the generation,
+ * and replayed on top of the checkpoint when the target is created.  The
+ * blocks the map path heals or consumes write failures of only mark the
+ * map dirty and are saved by the next checkpoint.  A checkpoint goes to
+ * the slot not in use and starts a new generation, which empties the
+ * journal.
+ */
+#define DUST_MD_MAGIC		0x54535544	/* "DUST" */
+#define DUST_MD_VERSION		3
+#define DUST_MD_JOURNAL_START	8
+#define DUST_MD_JOURNAL_SECTORS	16384
+#define DUST_MD_CKPT_START	\
+	(DUST_MD_JOURNAL_START + DUST_MD_JOURNAL_SECTORS)
+#define DUST_MD_COMMIT_DELAY	HZ
+
+/*
+ * The journal is read back in chunks of this many sectors.
+ */
+#define DUST_MD_READ_SECTORS	256
+
+struct dust_md_sb {
+	__le32 csum;
+	__le32 magic;
+	__le32 version;
+	__le32 blksz;
+	__le64 gen;
+	__le64 nr;
+	__le32 slot;
+	__le32 ckpt_csum;
+} __packed;
+
+struct dust_md_extent {
+	__le64 bb;
+	__le64 len;
+	__le32 delay_us;
+	__le32 wr_fail_cnt;
+	__u8 flags;
+	__u8 pad[7];
+} __packed;
+
+#define DUST_MD_SET_CNT		0x1
+#define DUST_MD_SET_DELAY	0x2
+
+struct dust_md_entry {
+	__le32 csum;
+	__le64 gen;
+	__le64 first;
+	__le64 last;
+	__le32 delay_us;
+	__le32 wr_fail_cnt;
+	__u8 set;
+	__u8 clear;
+	__u8 op_flags;
+	__u8 pad;
+} __packed;
+
+#define DUST_MD_ENTRIES_PER_SECTOR (SECTOR_SIZE / sizeof(struct dust_md_entry))
+#define DUST_MD_JOURNAL_ENTRIES \
+	(DUST_MD_JOURNAL_SECTORS * DUST_MD_ENTRIES_PER_SECTOR)
+
+/*
+ * lock serializes messages, journal appends and checkpoints.  jsect is
+ * the journal sector that entry jpos goes to, as far as it is filled.
+ */
+struct dust_md {
+	struct dust_device *dd;
+	struct dm_dev *dev;
+	struct dm_io_client *io;
+	struct mutex lock;
+	struct delayed_work work;
+	u64 gen;
+	unsigned int slot;
+	sector_t slot_sectors;
+	unsigned long jpos;
+	void *jsect;
+	bool dirty;
+};
+
+/*
+ * A change to a block range, as given to addbadrange or removebadrange.
+ * arg is the write fail count or delay of an add.
+ */
+struct dust_range_cmd {
+	bool add;
+	unsigned char flag;
+	sector_t first;
+	sector_t last;
+	unsigned int arg;
+};
+
+/*
+ * A fault schedule: range changes sorted by their offset from the start
+ * of the schedule.  While it runs, a timer fires when the change at pos
+ * is due and the work applies every change due by then, under the
+ * metadata lock like a message.  lock serializes loading, starting and
+ * stopping with the work and nests inside the metadata lock.
+ */
+struct dust_sched_ent {
+	u64 at_ns;
+	struct dust_range_cmd cmd;
+};
+
+#define DUST_SCHED_MAX_ENTRIES	4096
+
+struct dust_sched {
+	struct mutex lock;
+	struct dust_sched_ent *ents;
+	unsigned int nr;
+	unsigned int size;
+	unsigned int pos;
+	ktime_t start;
+	struct hrtimer timer;
+	struct work_struct work;
+	bool running;
+};
+
+/*
+ * Range changes made once the device has seen a number of reads, writes
+ * or bytes more than when they were loaded.  The map path counts in
+ * per-CPU batches and compares the approximate total with next, the
+ * lowest threshold of each kind, so a trigger fires at most a batch per
+ * CPU late.  The work then sums the counters exactly and makes the
+ * changes that are due.  The first bio to see a threshold crossed sets
+ * DUST_TRIG_PENDING and queues the work; the work clears it once next
+ * is recomputed.  A threshold the approximate total passes before the
+ * exact one does is moved up by the shortfall, so such a crossing
+ * queues the work once more rather than on every bio that follows.
+ * lock nests inside the metadata lock.
+ */
+enum dust_trig_kind {
+	DUST_TRIG_READS,
+	DUST_TRIG_WRITES,
+	DUST_TRIG_BYTES,
+	DUST_TRIG_NR,
+};
+
+#define DUST_TRIG_BATCH		64
+#define DUST_TRIG_BYTES_BATCH	(1 << 20)
+#define DUST_TRIG_PENDING	0
+#define DUST_MAX_TRIGGERS	1024
+
+struct dust_trigger {
+	struct list_head list;
+	enum dust_trig_kind kind;
+	s64 at;
+	struct dust_range_cmd cmd;
+};
+
+struct dust_triggers {
+	struct mutex lock;
+	struct list_head list;
+	unsigned int nr;
+	bool armed;
+	unsigned long flags;
+	s64 next[DUST_TRIG_NR];
+	struct percpu_counter count[DUST_TRIG_NR];
+	struct work_struct work;
+};
+
+/*
+ * What a discard or write zeroes bio does to the bad blocks it covers:
+ * heal the read bad ones and fail on the ones a write fails on, write
+ * bad ones and read bad ones with write failures left, fail on any of
+ * them, or leave them alone.  Either way the bio
+ * is checked as one range and passed on or failed as a whole.
+ */
+enum dust_discard {
+	DUST_DISCARD_HEAL,
+	DUST_DISCARD_FAIL,
+	DUST_DISCARD_IGNORE,
+};
+
+/*
+ * With the badblocks feature, the read bad ranges under a target are
+ * copied to the bad block table of its disk this long after the list
+ * changed.  The table holds a few hundred ranges and no bio is checked
+ * against it; it tells upper layers which sectors to stay away from.
+ */
+#define DUST_PUB_DELAY (HZ / 10)
+
+struct dust_device {
+	struct dm_target *ti;
+	struct dm_dev *dev;
+	struct dust_md *md;
+	struct dust_stats __percpu *stats;
+	struct dust_lat __percpu *lat;
+	struct dust_delay_queue __percpu *delay_queues;
+	struct rnd_state __percpu *rnd_state;
+	struct dust_event_ring __percpu *events;
+	struct mutex event_lock;
+	struct ratelimit_state event_rs;
+	struct dust_rate fail_rate[2];
+	u64 rand_seed;
+	struct dust_sched sched;
+	struct dust_triggers trig;
+	struct dust_bblist *bbl;
+	struct badblocks *bb;
+	struct delayed_work bb_work;
+	struct list_head bb_list;
+	bool bb_published;
+	enum dust_discard discard;
 	unsigned int blksz;
 	int sect_per_block_shift;
 	unsigned int sect_per_block;
 	sector_t start;
-	bool fail_write_on_bb:1;
-	bool fail_read_on_bb:1;
-	bool quiet_mode:1;
+	unsigned int delay_us;
+	unsigned int delay_jitter_us;
+	blk_status_t error_status;
+	bool fail_write_on_bb;
+	bool fail_read_on_bb;
+	bool delay_on_bb;
+	bool corrupt_on_bb;
+	bool delay_suspended;
+	bool lat_on;
+	unsigned int corrupt_offset;
+	u8 corrupt_xor;
+	bool quiet_mode;
 };
 
-static struct badblock *dust_rb_search(struct rb_root *root, sector_t blk)
-{
-	struct rb_node *node = root->rb_node;
+/*
+ * A change to the failure modes of a block range: the flags to set and
+ * to clear, and optionally a new write fail count or delay.  A strict
+ * update fails if a block to set is already bad in that mode, or a block
+ * to clear is not.
+ */
+struct dust_bb_op {
+	unsigned char set;
+	unsigned char clear;
+	bool set_cnt;
+	unsigned int wr_fail_cnt;
+	bool set_delay;
+	unsigned int delay_us;
+	bool strict;
+};
 
-	while (node) {
-		struct badblock *bblk = rb_entry(node, struct badblock, node);
+/*
+ * A block range to update.  Bulk loads sort their ranges and coalesce
+ * them so that they never overlap.
+ */
+struct dust_range {
+	sector_t first;
+	sector_t last;
+};
 
-		if (bblk->bb > blk)
-			node = node->rb_left;
-		else if (bblk->bb < blk)
-			node = node->rb_right;
-		else
-			return bblk;
-	}
+/*
+ * Bulk updates drop dust_lock after this many ranges so that a large
+ * load does not keep interrupts disabled for long.
+ */
+#define DUST_BULK_BATCH 1024
 
-	return NULL;
-}
+/*
+ * Largest block list file accepted by loadbadblocks: 8M blocks.
+ */
+#define DUST_BULK_MAX_SIZE (64 << 20)
 
+/*
+ * Extents preallocated for an update, which runs under dust_lock.
+ * The map path only ever needs to split the two ends of a range and
+ * uses the inline slots.
+ */
+struct dust_prealloc {
+	struct badblock **nodes;
+	unsigned int nr;
+	unsigned int size;
+	struct badblock *inline_nodes[2];
+};
 
-static bool dust_rb_insert(struct rb_root *root, struct badblock *new)
-{
-	struct badblock *bblk;
-	struct rb_node **link = &root->rb_node, *parent = NULL;
-	sector_t value = new->bb;
+/*
+ * Enabled while at least one dust target fails reads or writes on bad
+ * blocks, delays bios or corrupts them.  Until then every target remaps
+ * bios like dm-linear without looking at its flags or bad block lists.
+ */
+static DEFINE_STATIC_KEY_FALSE(dust_fail_key);
+static DEFINE_MUTEX(dust_fail_mode_lock);
 
-	while (*link) {
-		parent = *link;
-		bblk = rb_entry(parent, struct badblock, node);
+static LIST_HEAD(dust_bblists);
+static DEFINE_MUTEX(dust_bblist_lock);
 
-		if (bblk->bb > value)
-			link = &(*link)->rb_left;
-		else if (bblk->bb < value)
-			link = &(*link)->rb_right;
-		else
-			return false;
-	}
+/*
+ * Extents come from a dedicated slab cache.  The message path allocates
+ * from the cache directly; the map path, which must not sleep, can fall
+ * back on a small reserve shared by all targets.  Every free goes
+ * through the mempool so the reserve refills itself.
+ */
+#define DUST_BB_POOL_SIZE 64
 
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
+static struct kmem_cache *badblock_cache;
+static mempool_t *badblock_pool;
 
-	return true;
+static void dust_bb_free(struct badblock *bblk)
+{
+	mempool_free(bblk, badblock_pool);
 }
 
-static int dust_remove_block(struct dust_device *dd, unsigned long long block, bool mode)
+static void dust_bb_free_rcu(struct rcu_head *rcu)
 {
-	struct badblock *bblock;
-	unsigned long flags;
+	dust_bb_free(container_of(rcu, struct badblock, rcu));
+}
 
-	spin_lock_irqsave(&dd->dust_lock, flags);
-	if(mode == RD)
-		bblock = dust_rb_search(&dd->badblocklist_read, block);
-	else
-		bblock = dust_rb_search(&dd->badblocklist_write, block);
+/*
+ * Trees detached by clearbadblocks or left behind by a destroyed target
+ * are freed in the background, so neither the message nor the table
+ * reload waits for millions of extents to be freed.
+ */
+struct dust_reaper {
+	struct work_struct work;
+	struct rb_root tree;
+};
 
-	if (bblock == NULL) {
-		if (!dd->quiet_mode) {
-			DMERR("%s: block %llu not found in badblocklist_read",
-			      __func__, block);
-		}
-		spin_unlock_irqrestore(&dd->dust_lock, flags);
-		return -EINVAL;
-	}
+static struct workqueue_struct *dust_wq;
 
-	if(mode == RD)
-		rb_erase(&bblock->node, &dd->badblocklist_read);
-	else
-		rb_erase(&bblock->node, &dd->badblocklist_write);
-	if(mode == RD)
-		dd->badblock_count_read--;
-	else
-		dd->badblock_count_write--;
-	if (!dd->quiet_mode)
-		DMINFO("%s: badblock removed at block %llu", __func__, block);
-	kfree(bblock);
-	spin_unlock_irqrestore(&dd->dust_lock, flags);
+/*
+ * Delayed bios are resubmitted from here; the I/O path must make
+ * progress under memory pressure.
+ */
+static struct workqueue_struct *dust_delay_wq;
 
-	return 0;
+/*
+ * The list changed in a way the journal does not record; save it with
+ * the next checkpoint.  Safe to call from the map path.
+ */
+static void dust_md_mark_dirty(struct dust_device *dd)
+{
+	if (dd->md && !READ_ONCE(dd->md->dirty)) {
+		WRITE_ONCE(dd->md->dirty, true);
+		queue_delayed_work(dust_wq, &dd->md->work,
+				   DUST_MD_COMMIT_DELAY);
+	}
 }
 
-static int dust_add_block(struct dust_device *dd, unsigned long long block,
-			  unsigned char wr_fail_cnt, bool mode)
+static inline unsigned char dust_mode_flag(bool mode)
 {
-	struct badblock *bblock;
-	unsigned long flags;
+	return mode == RD ? DUST_BB_READ : DUST_BB_WRITE;
+}
 
-	bblock = kmalloc(sizeof(*bblock), GFP_KERNEL);
-	if (bblock == NULL) {
-		if (!dd->quiet_mode)
-			DMERR("%s: badblock allocation failed", __func__);
-		return -ENOMEM;
-	}
+/*
+ * The status failed bios complete with.
+ */
+static const struct {
+	const char *name;
+	blk_status_t status;
+} dust_error_statuses[] = {
+	{ "ioerr", BLK_STS_IOERR },
+	{ "medium", BLK_STS_MEDIUM },
+	{ "timeout", BLK_STS_TIMEOUT },
+	{ "target", BLK_STS_TARGET },
+};
 
-	spin_lock_irqsave(&dd->dust_lock, flags);
-	bblock->bb = block;
-	bblock->wr_fail_cnt = wr_fail_cnt;
-	if(mode == RD) {
-		if (!dust_rb_insert(&dd->badblocklist_read, bblock)) {
-			if (!dd->quiet_mode) {
-				DMERR("%s: block %llu already in badblocklist",
-			      		__func__, block);
-			}
-			spin_unlock_irqrestore(&dd->dust_lock, flags);
-			kfree(bblock);
-			return -EINVAL;
-		}
-	}
-	else {
-		if (!dust_rb_insert(&dd->badblocklist_write, bblock)) {
-			if (!dd->quiet_mode) {
-				DMERR("%s: block %llu already in badblocklist",
-			      		__func__, block);
-			}
-			spin_unlock_irqrestore(&dd->dust_lock, flags);
-			kfree(bblock);
-			return -EINVAL;
+static int dust_parse_error_status(const char *name, blk_status_t *status)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(dust_error_statuses); i++) {
+		if (!strcasecmp(name, dust_error_statuses[i].name)) {
+			*status = dust_error_statuses[i].status;
+			return 0;
 		}
 	}
 
-	if(mode == RD)
-		dd->badblock_count_read++;
-	else
-		dd->badblock_count_write++;
+	return -EINVAL;
+}
 
-	if (!dd->quiet_mode) {
-		DMINFO("%s: badblock added at block %llu with write fail count %hhu",
-		       __func__, block, wr_fail_cnt);
-	}
-	spin_unlock_irqrestore(&dd->dust_lock, flags);
+static const char *dust_error_status_name(blk_status_t status)
+{
+	unsigned int i;
 
-	return 0;
+	for (i = 0; i < ARRAY_SIZE(dust_error_statuses); i++)
+		if (dust_error_statuses[i].status == status)
+			return dust_error_statuses[i].name;
+
+	return "ioerr";
 }
 
+static const char *dust_flag_name(unsigned char flag)
+{
+	switch (flag) {
+	case DUST_BB_READ:
+		return "read";
+	case DUST_BB_WRITE:
+		return "write";
+	case DUST_BB_SLOW:
+		return "slow";
+	default:
+		return "corrupt";
+	}
+}
 
-static int dust_query_block(struct dust_device *dd, unsigned long long block, bool mode)
+/*
+ * The shard holding blk.
+ */
+static inline struct dust_shard *dust_shard(struct dust_device *dd,
+					    sector_t blk)
 {
-	struct badblock *bblock;
-	unsigned long flags;
+	sector_t i = blk >> dd->bbl->shard_shift;
 
-	spin_lock_irqsave(&dd->dust_lock, flags);
-	if(mode == RD)
-		bblock = dust_rb_search(&dd->badblocklist_read, block);
-	else
-		bblock = dust_rb_search(&dd->badblocklist_write, block);
-	if (bblock != NULL)
-		DMINFO("%s: block %llu found in badblocklist", __func__, block);
-	else
-		DMINFO("%s: block %llu not found in badblocklist", __func__, block);
-	spin_unlock_irqrestore(&dd->dust_lock, flags);
+	return &dd->bbl->shards[min_t(sector_t, i, dd->bbl->nr_shards - 1)];
+}
 
-	return 0;
+static inline sector_t dust_shard_first(struct dust_shard *sh)
+{
+	struct dust_bblist *bbl = sh->bbl;
+
+	return (sector_t)(sh - bbl->shards) << bbl->shard_shift;
 }
 
-static int __dust_map_read(struct dust_device *dd, sector_t thisblock)
+/*
+ * The last block of the shard; the last shard reaches to the end of the
+ * block space.
+ */
+static inline sector_t dust_shard_last(struct dust_shard *sh)
 {
-	struct badblock *bblk = dust_rb_search(&dd->badblocklist_read, thisblock);
+	struct dust_bblist *bbl = sh->bbl;
 
-	if (bblk)
-		return DM_MAPIO_KILL;
+	if (sh == &bbl->shards[bbl->nr_shards - 1])
+		return (sector_t)-1;
 
-	return DM_MAPIO_REMAPPED;
+	return dust_shard_first(sh) + ((sector_t)1 << bbl->shard_shift) - 1;
 }
 
-static int dust_map_read(struct dust_device *dd, sector_t thisblock,
-			 bool fail_read_on_bb)
+static unsigned long long dust_shard_count(struct dust_shard *sh,
+					   unsigned char flag)
+{
+	switch (flag) {
+	case DUST_BB_READ:
+		return sh->badblock_count_read;
+	case DUST_BB_WRITE:
+		return sh->badblock_count_write;
+	case DUST_BB_SLOW:
+		return sh->badblock_count_slow;
+	default:
+		return sh->badblock_count_corrupt;
+	}
+}
+
+static const char * const dust_event_names[] = {
+	[DUST_EV_KILL] = "kill",
+	[DUST_EV_HEAL] = "heal",
+	[DUST_EV_ADD] = "add",
+	[DUST_EV_REMOVE] = "remove",
+};
+
+/*
+ * Record an event in the ring of this CPU, overwriting the oldest one
+ * when the ring is full.  Unless the target is quiet, the event is also
+ * logged, but at most a burst of messages per interval; printk notes
+ * how many were suppressed.  Safe in any context.
+ */
+static void dust_event(struct dust_device *dd, enum dust_event_type type,
+		       unsigned char flag, sector_t first, sector_t last,
+		       u32 arg)
 {
+	struct dust_event_ring *ring;
+	struct dust_event *e;
 	unsigned long flags;
-	int r = DM_MAPIO_REMAPPED;
 
-	if (fail_read_on_bb) {
-		thisblock >>= dd->sect_per_block_shift;
-		spin_lock_irqsave(&dd->dust_lock, flags);
-		r = __dust_map_read(dd, thisblock);
-		spin_unlock_irqrestore(&dd->dust_lock, flags);
+	local_irq_save(flags);
+	ring = this_cpu_ptr(dd->events);
+	write_seqcount_begin(&ring->seq);
+	e = &ring->ev[ring->head % DUST_EVENTS];
+	e->time_ns = ktime_get_ns();
+	e->first = first;
+	e->last = last;
+	e->arg = arg;
+	e->type = type;
+	e->flag = flag;
+	ring->head++;
+	write_seqcount_end(&ring->seq);
+	local_irq_restore(flags);
+
+	if (!dd->quiet_mode && __ratelimit(&dd->event_rs)) {
+		DMINFO("%s: %s %s blocks %llu-%llu (%u)", dd->dev->name,
+		       dust_event_names[type], dust_flag_name(flag),
+		       (unsigned long long)first, (unsigned long long)last,
+		       arg);
+	}
+}
+
+static inline sector_t dust_bb_last(const struct badblock *bblk)
+{
+	return bblk->bb + bblk->len - 1;
+}
+
+static inline struct badblock *dust_bb_next(struct badblock *bblk)
+{
+	return rb_entry_safe(rb_next(&bblk->node), struct badblock, node);
+}
+
+/*
+ * Return the extent containing blk or, if there is none, the first one
+ * after it.
+ */
+static struct badblock *dust_rb_lower_bound(struct rb_root *root, sector_t blk)
+{
+	struct rb_node *node = root->rb_node;
+	struct badblock *found = NULL;
+
+	while (node) {
+		struct badblock *bblk = rb_entry(node, struct badblock, node);
+
+		if (bblk->bb > blk) {
+			found = bblk;
+			node = node->rb_left;
+		} else if (dust_bb_last(bblk) < blk)
+			node = node->rb_right;
+		else
+			return bblk;
+	}
+
+	return found;
+}
+
+static struct badblock *dust_rb_search(struct rb_root *root, sector_t blk)
+{
+	struct badblock *bblk = dust_rb_lower_bound(root, blk);
+
+	if (bblk && bblk->bb <= blk)
+		return bblk;
+
+	return NULL;
+}
+
+static int dust_filter_init(struct dust_filter *f, sector_t blocks)
+{
+	f->shift = 0;
+	while ((blocks >> f->shift) >= DUST_FILTER_MAX_BITS)
+		f->shift++;
+	f->nr = (blocks >> f->shift) + 1;
+	f->bits = kvzalloc(BITS_TO_LONGS(f->nr) * sizeof(unsigned long),
+			   GFP_KERNEL);
+
+	return f->bits ? 0 : -ENOMEM;
+}
+
+/*
+ * Whether an extent may overlap [first, last].  Blocks past the end of
+ * the bitmap, after the device grew, always may.
+ */
+static bool dust_filter_test(const struct dust_filter *f, sector_t first,
+			     sector_t last)
+{
+	unsigned long c0 = first >> f->shift, c1 = last >> f->shift;
+
+	if (c1 >= f->nr)
+		return true;
+
+	return find_next_bit(f->bits, c1 + 1, c0) <= c1;
+}
+
+static void dust_filter_set(struct dust_filter *f, sector_t first,
+			    sector_t last)
+{
+	unsigned long c0 = first >> f->shift, c1 = last >> f->shift;
+
+	if (c0 >= f->nr)
+		return;
+
+	c1 = min(c1, f->nr - 1);
+	bitmap_set(f->bits, c0, c1 - c0 + 1);
+}
+
+/*
+ * Recompute the bits of the chunks covering [first, last], which lies
+ * in sh, from the tree of sh, after extents in the range lost flags or
+ * went away.
+ */
+static void dust_filter_refresh(struct dust_shard *sh, sector_t first,
+				sector_t last)
+{
+	struct dust_filter *f = &sh->bbl->filter;
+	unsigned long c, c1 = last >> f->shift;
+	struct badblock *bblk;
+	sector_t start;
+
+	c = first >> f->shift;
+	if (c >= f->nr)
+		return;
+
+	c1 = min(c1, f->nr - 1);
+	bblk = dust_rb_lower_bound(&sh->badblocklist, (sector_t)c << f->shift);
+	for (; c <= c1; c++) {
+		start = (sector_t)c << f->shift;
+		while (bblk && dust_bb_last(bblk) < start)
+			bblk = dust_bb_next(bblk);
+		if (bblk && bblk->bb < start + (1UL << f->shift))
+			__set_bit(c, f->bits);
+		else
+			__clear_bit(c, f->bits);
+	}
+}
+
+/*
+ * Look [first, last] up in the array index.  Returns false if the array
+ * is missing or out of date and the tree has to be walked instead.
+ */
+static bool dust_array_range(struct dust_shard *sh, sector_t first,
+			     sector_t last, unsigned char mask,
+			     struct badblock **found, unsigned int *depth)
+{
+	struct dust_array *a = rcu_dereference(sh->array[numa_node_id()]);
+	struct badblock *bblk = NULL;
+	unsigned long lo = 0, hi, mid;
+	unsigned int seq;
+
+	if (a == NULL)
+		return false;
+
+	seq = read_seqcount_begin(&sh->dust_seq);
+	if (seq != a->seq)
+		return false;
+
+	hi = a->nr;
+	while (lo < hi) {
+		(*depth)++;
+		mid = lo + (hi - lo) / 2;
+		if (a->keys[mid] <= first)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && a->keys[lo - 1] + a->ents[lo - 1].len > first)
+		lo--;
+
+	for (; lo < a->nr && a->keys[lo] <= last; lo++) {
+		(*depth)++;
+		if (a->ents[lo].flags & mask) {
+			bblk = a->ents[lo].bblk;
+			break;
+		}
+	}
+
+	if (read_seqcount_retry(&sh->dust_seq, seq))
+		return false;
+
+	*found = bblk;
+
+	return true;
+}
+
+static void dust_array_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct dust_array, rcu));
+}
+
+static inline size_t dust_array_size(unsigned long nr)
+{
+	return sizeof(struct dust_array) +
+	       nr * (sizeof(sector_t) + sizeof(struct dust_array_ent));
+}
+
+static struct dust_array *dust_array_alloc(unsigned long nr, int node)
+{
+	struct dust_array *a = kvmalloc_node(dust_array_size(nr), GFP_KERNEL,
+					     node);
+
+	if (a) {
+		a->nr = nr;
+		a->ents = (struct dust_array_ent *)&a->keys[nr];
+	}
+
+	return a;
+}
+
+/*
+ * A replica of a in the memory of node, or NULL.
+ */
+static struct dust_array *dust_array_copy(struct dust_array *a, int node)
+{
+	struct dust_array *c = dust_array_alloc(a->nr, node);
+
+	if (c) {
+		memcpy(c->keys, a->keys, dust_array_size(a->nr) - sizeof(*a));
+		c->seq = a->seq;
+	}
+
+	return c;
+}
+
+/*
+ * Replace the array of node.  Without a new one, lookups on the node go
+ * to the tree until the next rebuild.
+ */
+static void dust_array_publish(struct dust_shard *sh, int node,
+			       struct dust_array *a)
+{
+	struct dust_array *old = rcu_dereference_protected(sh->array[node], 1);
+
+	rcu_assign_pointer(sh->array[node], a);
+	if (old)
+		call_rcu(&old->rcu, dust_array_free_rcu);
+}
+
+/*
+ * Walk the tree as of seq, counting its extents and recording them in a
+ * if given.  Returns false once the tree changed.
+ */
+static bool dust_array_walk(struct dust_shard *sh, unsigned int seq,
+			    struct dust_array *a, unsigned long *nr)
+{
+	struct badblock *bblk;
+	struct rb_node *node;
+	unsigned long n = 0;
+
+	node = rb_first(&sh->badblocklist);
+	for (; node; node = rb_next(node), n++) {
+		if (read_seqcount_retry(&sh->dust_seq, seq))
+			return false;
+		if (a == NULL)
+			continue;
+		if (n == a->nr)
+			return false;
+		bblk = rb_entry(node, struct badblock, node);
+		a->keys[n] = bblk->bb;
+		a->ents[n].bblk = bblk;
+		a->ents[n].len = bblk->len;
+		a->ents[n].flags = bblk->flags;
+	}
+
+	*nr = n;
+
+	return !read_seqcount_retry(&sh->dust_seq, seq);
+}
+
+/*
+ * Build a new array from the tree without taking dust_lock, and copy it
+ * to the other nodes.  If the tree changes meanwhile, try again later.
+ */
+static void dust_index_work(struct work_struct *work)
+{
+	struct dust_shard *sh = container_of(to_delayed_work(work),
+					     struct dust_shard, index_work);
+	int home = numa_node_id(), node;
+	struct dust_array *a;
+	unsigned long nr;
+	unsigned int seq;
+	bool ok;
+
+	rcu_read_lock();
+	seq = read_seqcount_begin(&sh->dust_seq);
+	ok = dust_array_walk(sh, seq, NULL, &nr);
+	rcu_read_unlock();
+	if (!ok)
+		goto again;
+
+	a = dust_array_alloc(nr, home);
+	if (a == NULL)
+		goto again;
+	a->seq = seq;
+
+	rcu_read_lock();
+	ok = dust_array_walk(sh, seq, a, &nr);
+	rcu_read_unlock();
+	if (!ok || nr != a->nr) {
+		kvfree(a);
+		goto again;
+	}
+
+	for_each_online_node(node)
+		if (node != home)
+			dust_array_publish(sh, node, dust_array_copy(a, node));
+	dust_array_publish(sh, home, a);
+
+	return;
+again:
+	queue_delayed_work(dust_wq, &sh->index_work, DUST_INDEX_DELAY);
+}
+
+/*
+ * Have the targets that publish bbl to their disk publish it again.
+ */
+static void dust_pub_update(struct dust_bblist *bbl)
+{
+	struct dust_device *dd;
+	unsigned long flags;
+
+	if (!READ_ONCE(bbl->nr_pubs))
+		return;
+
+	spin_lock_irqsave(&bbl->pub_lock, flags);
+	list_for_each_entry(dd, &bbl->pubs, bb_list)
+		queue_delayed_work(dust_wq, &dd->bb_work, DUST_PUB_DELAY);
+	spin_unlock_irqrestore(&bbl->pub_lock, flags);
+}
+
+/*
+ * Called after every change to the tree of sh.  Only the blocks that
+ * fail reads are published, so read says whether any of them changed.
+ */
+static void dust_index_update(struct dust_shard *sh, bool read)
+{
+	if (sh->bbl->index == DUST_INDEX_ARRAY)
+		queue_delayed_work(dust_wq, &sh->index_work, DUST_INDEX_DELAY);
+	if (read)
+		dust_pub_update(sh->bbl);
+}
+
+/*
+ * Return the first extent of sh overlapping [first, last] that is bad in
+ * one of the modes in mask, or NULL.  The extents or array entries
+ * visited are added to depth, for the tracepoints.
+ *
+ * This is the lockless lookup of the map path, called under
+ * rcu_read_lock().  Writers modify the bad block list under dust_lock
+ * inside a dust_seq write section and only free extents after an RCU
+ * grace period.  The rbtree code never creates loops for concurrent
+ * readers, so a descent that races with a rebalance can at worst miss an
+ * entry; the sequence count detects that and the walk is retried.
+ * Skipping extents of the other mode with rb_next() also follows parent
+ * pointers, so the sequence count is checked before every step.
+ */
+static struct badblock *__dust_rb_range_rcu(struct dust_shard *sh,
+					    sector_t first, sector_t last,
+					    unsigned char mask,
+					    unsigned int *depth)
+{
+	struct rb_node *node;
+	struct badblock *bblk;
+	unsigned int seq;
+
+	if (sh->bbl->index == DUST_INDEX_ARRAY &&
+	    dust_array_range(sh, first, last, mask, &bblk, depth))
+		return bblk;
+
+retry:
+	seq = read_seqcount_begin(&sh->dust_seq);
+	bblk = NULL;
+	node = rcu_dereference_raw(sh->badblocklist.rb_node);
+	while (node) {
+		struct badblock *b = rb_entry(node, struct badblock, node);
+
+		(*depth)++;
+		if (b->bb > first) {
+			bblk = b;
+			node = rcu_dereference_raw(node->rb_left);
+		} else if (b->bb + READ_ONCE(b->len) <= first)
+			node = rcu_dereference_raw(node->rb_right);
+		else {
+			bblk = b;
+			break;
+		}
+	}
+
+	while (bblk && bblk->bb <= last && !(READ_ONCE(bblk->flags) & mask)) {
+		if (read_seqcount_retry(&sh->dust_seq, seq))
+			goto retry;
+		bblk = dust_bb_next(bblk);
+		(*depth)++;
+	}
+
+	if (read_seqcount_retry(&sh->dust_seq, seq))
+		goto retry;
+
+	if (bblk && bblk->bb > last)
+		return NULL;
+
+	return bblk;
+}
+
+/*
+ * Return the first extent overlapping [first, last] that is bad in one
+ * of the modes in mask, or NULL, looking in every shard the range
+ * covers.  depth is set to the number of extents or array entries
+ * visited.  Called under rcu_read_lock().
+ */
+static struct badblock *dust_rb_range_rcu(struct dust_device *dd,
+					  sector_t first, sector_t last,
+					  unsigned char mask,
+					  unsigned int *depth)
+{
+	struct badblock *bblk;
+	struct dust_shard *sh;
+	sector_t end;
+
+	*depth = 0;
+	if (!dust_filter_test(&dd->bbl->filter, first, last))
+		return NULL;
+
+	for (;;) {
+		sh = dust_shard(dd, first);
+		end = min(last, dust_shard_last(sh));
+		bblk = __dust_rb_range_rcu(sh, first, end, mask, depth);
+		if (bblk || end == last)
+			return bblk;
+		first = end + 1;
+	}
+}
+
+static bool dust_rb_insert(struct rb_root *root, struct badblock *new)
+{
+	struct badblock *bblk;
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	sector_t value = new->bb;
+
+	while (*link) {
+		parent = *link;
+		bblk = rb_entry(parent, struct badblock, node);
+
+		if (bblk->bb > value)
+			link = &(*link)->rb_left;
+		else if (bblk->bb < value)
+			link = &(*link)->rb_right;
+		else
+			return false;
+	}
+
+	rb_link_node_rcu(&new->node, parent, link);
+	rb_insert_color(&new->node, root);
+
+	return true;
+}
+
+static void dust_prealloc_init(struct dust_prealloc *pa)
+{
+	pa->nodes = pa->inline_nodes;
+	pa->nr = 0;
+	pa->size = ARRAY_SIZE(pa->inline_nodes);
+}
+
+/*
+ * Make sure pa holds at least needed extents.  Only callers that may
+ * sleep ever need more than the inline slots; the others dip into the
+ * mempool reserve.
+ */
+static int dust_prealloc_fill(struct dust_prealloc *pa, unsigned int needed,
+			      gfp_t gfp)
+{
+	struct badblock **nodes;
+
+	if (needed > pa->size) {
+		nodes = kvmalloc_array(needed, sizeof(*nodes), gfp);
+		if (nodes == NULL)
+			return -ENOMEM;
+		memcpy(nodes, pa->nodes, pa->nr * sizeof(*nodes));
+		if (pa->nodes != pa->inline_nodes)
+			kvfree(pa->nodes);
+		pa->nodes = nodes;
+		pa->size = needed;
+	}
+
+	while (pa->nr < needed) {
+		if (gfpflags_allow_blocking(gfp))
+			pa->nodes[pa->nr] = kmem_cache_alloc(badblock_cache,
+							     gfp);
+		else
+			pa->nodes[pa->nr] = mempool_alloc(badblock_pool, gfp);
+		if (pa->nodes[pa->nr] == NULL)
+			return -ENOMEM;
+		pa->nr++;
+	}
+
+	return 0;
+}
+
+static void dust_prealloc_release(struct dust_prealloc *pa)
+{
+	while (pa->nr)
+		dust_bb_free(pa->nodes[--pa->nr]);
+	if (pa->nodes != pa->inline_nodes)
+		kvfree(pa->nodes);
+}
+
+static struct badblock *dust_prealloc_take(struct dust_prealloc *pa)
+{
+	BUG_ON(!pa->nr);
+	return pa->nodes[--pa->nr];
+}
+
+/*
+ * The helpers below modify the tree of a shard and are called with its
+ * dust_lock held, inside a dust_seq write section.  The block ranges
+ * they are given lie in the shard.
+ */
+static void dust_bb_account(struct dust_shard *sh, sector_t len,
+			    unsigned char old_flags, unsigned char new_flags)
+{
+	unsigned char changed = old_flags ^ new_flags;
+
+	if (changed & DUST_BB_READ) {
+		if (new_flags & DUST_BB_READ)
+			sh->badblock_count_read += len;
+		else
+			sh->badblock_count_read -= len;
+	}
+
+	if (changed & DUST_BB_WRITE) {
+		if (new_flags & DUST_BB_WRITE)
+			sh->badblock_count_write += len;
+		else
+			sh->badblock_count_write -= len;
+	}
+
+	if (changed & DUST_BB_SLOW) {
+		if (new_flags & DUST_BB_SLOW)
+			sh->badblock_count_slow += len;
+		else
+			sh->badblock_count_slow -= len;
+	}
+
+	if (changed & DUST_BB_CORRUPT) {
+		if (new_flags & DUST_BB_CORRUPT)
+			sh->badblock_count_corrupt += len;
+		else
+			sh->badblock_count_corrupt -= len;
+	}
+}
+
+static void dust_bb_erase(struct dust_shard *sh, struct badblock *bblk)
+{
+	rb_erase(&bblk->node, &sh->badblocklist);
+	call_rcu(&bblk->rcu, dust_bb_free_rcu);
+}
+
+/*
+ * Split bblk so that its second part starts at block at, and return
+ * the second part.
+ */
+static struct badblock *dust_bb_split(struct dust_shard *sh,
+				      struct badblock *bblk, sector_t at,
+				      struct dust_prealloc *pa)
+{
+	struct badblock *new = dust_prealloc_take(pa);
+
+	new->bb = at;
+	new->len = bblk->bb + bblk->len - at;
+	new->flags = bblk->flags;
+	atomic_set(&new->wr_fail_cnt, atomic_read(&bblk->wr_fail_cnt));
+	new->delay_us = bblk->delay_us;
+	WRITE_ONCE(bblk->len, at - bblk->bb);
+	dust_rb_insert(&sh->badblocklist, new);
+
+	return new;
+}
+
+static void dust_bb_new(struct dust_shard *sh, sector_t first, sector_t last,
+			const struct dust_bb_op *op, struct dust_prealloc *pa)
+{
+	struct badblock *new = dust_prealloc_take(pa);
+
+	new->bb = first;
+	new->len = last - first + 1;
+	new->flags = op->set;
+	atomic_set(&new->wr_fail_cnt, op->set_cnt ? op->wr_fail_cnt : 0);
+	new->delay_us = op->set_delay ? op->delay_us : 0;
+	dust_rb_insert(&sh->badblocklist, new);
+	dust_bb_account(sh, new->len, 0, new->flags);
+}
+
+static void dust_bb_apply(struct dust_shard *sh, struct badblock *bblk,
+			  const struct dust_bb_op *op)
+{
+	unsigned char flags = (bblk->flags & ~op->clear) | op->set;
+
+	dust_bb_account(sh, bblk->len, bblk->flags, flags);
+	if (!flags) {
+		dust_bb_erase(sh, bblk);
+		return;
+	}
+
+	if (!(flags & DUST_BB_READ))
+		atomic_set(&bblk->wr_fail_cnt, 0);
+	else if (op->set_cnt)
+		atomic_set(&bblk->wr_fail_cnt, op->wr_fail_cnt);
+	if (!(flags & DUST_BB_SLOW))
+		WRITE_ONCE(bblk->delay_us, 0);
+	else if (op->set_delay)
+		WRITE_ONCE(bblk->delay_us, op->delay_us);
+	WRITE_ONCE(bblk->flags, flags);
+}
+
+static bool dust_bb_mergeable(struct badblock *a, struct badblock *b)
+{
+	return a->bb + a->len == b->bb && a->flags == b->flags &&
+	       !atomic_read(&a->wr_fail_cnt) && !atomic_read(&b->wr_fail_cnt) &&
+	       a->delay_us == b->delay_us;
+}
+
+/*
+ * Merge the extents overlapping or adjacent to [first, last] with their
+ * neighbours where possible.
+ */
+static void dust_bb_merge(struct dust_shard *sh, sector_t first, sector_t last)
+{
+	struct badblock *bblk, *next;
+
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first ? first - 1 : 0);
+	while (bblk && bblk->bb <= last) {
+		next = dust_bb_next(bblk);
+		if (next && dust_bb_mergeable(bblk, next)) {
+			WRITE_ONCE(bblk->len, bblk->len + next->len);
+			dust_bb_erase(sh, next);
+			continue;
+		}
+		bblk = next;
+	}
+}
+
+/*
+ * Number of extents an update of [first, last] may have to allocate:
+ * one for each end of the range that splits an extent, and one for each
+ * gap between extents when setting flags.
+ */
+static unsigned int dust_bb_nodes_needed(struct dust_shard *sh,
+					 sector_t first, sector_t last,
+					 const struct dust_bb_op *op)
+{
+	struct badblock *bblk;
+	unsigned int nodes = 2;
+	sector_t pos = first;
+
+	if (!op->set)
+		return nodes;
+
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first);
+	for (; bblk && bblk->bb <= last; bblk = dust_bb_next(bblk)) {
+		if (bblk->bb > pos)
+			nodes++;
+		pos = dust_bb_last(bblk) + 1;
+	}
+	if (pos <= last)
+		nodes++;
+
+	return nodes;
+}
+
+static int dust_bb_check(struct dust_shard *sh, sector_t first, sector_t last,
+			 const struct dust_bb_op *op)
+{
+	struct badblock *bblk;
+	sector_t covered = 0;
+
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first);
+	for (; bblk && bblk->bb <= last; bblk = dust_bb_next(bblk)) {
+		if (bblk->flags & op->set)
+			return -EEXIST;
+		if (bblk->flags & op->clear)
+			covered += min(dust_bb_last(bblk), last) -
+				   max(bblk->bb, first) + 1;
+	}
+
+	if (op->clear && covered != last - first + 1)
+		return -ENOENT;
+
+	return 0;
+}
+
+/*
+ * Apply op to [first, last]: split the extents crossing either end of
+ * the range, update the ones inside it, fill the gaps when setting
+ * flags and merge what can be merged again.  pa must hold
+ * dust_bb_nodes_needed() extents.
+ */
+static void __dust_bb_update(struct dust_shard *sh, sector_t first,
+			     sector_t last, const struct dust_bb_op *op,
+			     struct dust_prealloc *pa)
+{
+	unsigned long long read = sh->badblock_count_read;
+	struct badblock *bblk, *next;
+	sector_t pos = first;
+
+	if (op->set)
+		dust_filter_set(&sh->bbl->filter, first, last);
+
+	write_seqcount_begin(&sh->dust_seq);
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first);
+	if (bblk && bblk->bb < first)
+		bblk = dust_bb_split(sh, bblk, first, pa);
+
+	for (; bblk && bblk->bb <= last; bblk = next) {
+		if (dust_bb_last(bblk) > last)
+			dust_bb_split(sh, bblk, last + 1, pa);
+		next = dust_bb_next(bblk);
+		if (bblk->bb > pos && op->set)
+			dust_bb_new(sh, pos, bblk->bb - 1, op, pa);
+		pos = dust_bb_last(bblk) + 1;
+		dust_bb_apply(sh, bblk, op);
+	}
+	if (pos <= last && op->set)
+		dust_bb_new(sh, pos, last, op, pa);
+
+	dust_bb_merge(sh, first, last);
+	write_seqcount_end(&sh->dust_seq);
+	/*
+	 * op sets or clears flags across the whole range, so the blocks
+	 * failing reads changed exactly when their count did.
+	 */
+	dust_index_update(sh, sh->badblock_count_read != read);
+
+	if (!op->set && op->clear)
+		dust_filter_refresh(sh, first, last);
+}
+
+static int dust_md_io(struct dust_md *md, int op, int op_flags,
+		      sector_t sector, sector_t count, void *buf)
+{
+	struct dm_io_region region = {
+		.bdev = md->dev->bdev,
+		.sector = sector,
+		.count = count,
+	};
+	struct dm_io_request req = {
+		.bi_op = op,
+		.bi_op_flags = op_flags,
+		.notify.fn = NULL,
+		.client = md->io,
+	};
+
+	if (is_vmalloc_addr(buf)) {
+		req.mem.type = DM_IO_VMA;
+		req.mem.ptr.vma = buf;
+	} else {
+		req.mem.type = DM_IO_KMEM;
+		req.mem.ptr.addr = buf;
+	}
+
+	return dm_io(&req, 1, &region, NULL);
+}
+
+/*
+ * Write the superblock for a new generation.  The flush makes the
+ * checkpoint it points to durable first.
+ */
+static int dust_md_write_sb(struct dust_md *md, unsigned int blksz, u64 gen,
+			    unsigned int slot, u64 nr, u32 ckpt_csum)
+{
+	struct dust_md_sb *sb;
+	int r;
+
+	sb = kzalloc(SECTOR_SIZE, GFP_KERNEL);
+	if (sb == NULL)
+		return -ENOMEM;
+
+	sb->magic = cpu_to_le32(DUST_MD_MAGIC);
+	sb->version = cpu_to_le32(DUST_MD_VERSION);
+	sb->blksz = cpu_to_le32(blksz);
+	sb->gen = cpu_to_le64(gen);
+	sb->nr = cpu_to_le64(nr);
+	sb->slot = cpu_to_le32(slot);
+	sb->ckpt_csum = cpu_to_le32(ckpt_csum);
+	sb->csum = cpu_to_le32(crc32c(0, &sb->magic,
+				      sizeof(*sb) - sizeof(sb->csum)));
+
+	r = dust_md_io(md, REQ_OP_WRITE, REQ_SYNC | REQ_PREFLUSH | REQ_FUA,
+		       0, 1, sb);
+	kfree(sb);
+
+	return r;
+}
+
+/*
+ * Copy the extents of sh into ext from n on, as far as size allows, and
+ * return the index after the last one.  The tree is walked without
+ * dust_lock, and walked again if the map path changed it meanwhile.
+ */
+static unsigned long dust_md_snapshot_shard(struct dust_shard *sh,
+					    struct dust_md_extent *ext,
+					    unsigned long size, unsigned long n)
+{
+	unsigned long start = n;
+	struct badblock *bblk;
+	struct rb_node *node;
+	unsigned int seq;
+	bool retry;
+
+	do {
+		n = start;
+		rcu_read_lock();
+		seq = read_seqcount_begin(&sh->dust_seq);
+		node = rb_first(&sh->badblocklist);
+		for (; node; node = rb_next(node), n++) {
+			if (read_seqcount_retry(&sh->dust_seq, seq))
+				break;
+			if (n >= size)
+				continue;
+			bblk = rb_entry(node, struct badblock, node);
+			ext[n].bb = cpu_to_le64(bblk->bb);
+			ext[n].len = cpu_to_le64(bblk->len);
+			ext[n].delay_us = cpu_to_le32(bblk->delay_us);
+			ext[n].flags = bblk->flags;
+			ext[n].wr_fail_cnt =
+				cpu_to_le32(atomic_read(&bblk->wr_fail_cnt));
+		}
+		retry = read_seqcount_retry(&sh->dust_seq, seq);
+		rcu_read_unlock();
+	} while (retry);
+
+	return n;
+}
+
+/*
+ * Copy the extent list into a buffer padded to whole sectors, shard by
+ * shard in block order.
+ */
+static int dust_md_snapshot(struct dust_device *dd,
+			    struct dust_md_extent **buf, unsigned long *nr)
+{
+	struct dust_md_extent *ext = NULL;
+	unsigned long n, size = 0;
+	unsigned int i;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < dd->bbl->nr_shards; i++)
+			n = dust_md_snapshot_shard(&dd->bbl->shards[i], ext,
+						   size, n);
+
+		if (n <= size)
+			break;
+
+		vfree(ext);
+		size = n + n / 8 + 1;
+		ext = vzalloc(round_up(size * sizeof(*ext), SECTOR_SIZE));
+		if (ext == NULL)
+			return -ENOMEM;
+		cond_resched();
+	}
+
+	*buf = ext;
+	*nr = n;
+
+	return 0;
+}
+
+/*
+ * Write a checkpoint of the whole list and start a new generation.
+ * Called with the metadata lock held.
+ */
+static int dust_md_commit(struct dust_device *dd)
+{
+	struct dust_md *md = dd->md;
+	unsigned int slot = !md->slot;
+	struct dust_md_extent *ext;
+	unsigned long nr;
+	sector_t sectors;
+	u32 csum;
+	int r;
+
+	WRITE_ONCE(md->dirty, false);
+	r = dust_md_snapshot(dd, &ext, &nr);
+	if (r)
+		goto out;
+
+	sectors = DIV_ROUND_UP(nr * sizeof(*ext), SECTOR_SIZE);
+	if (sectors > md->slot_sectors) {
+		DMERR("metadata device too small for %lu extents", nr);
+		r = -ENOSPC;
+		goto out_free;
+	}
+
+	csum = crc32c(0, ext, nr * sizeof(*ext));
+	if (sectors) {
+		r = dust_md_io(md, REQ_OP_WRITE, REQ_SYNC,
+			       DUST_MD_CKPT_START + slot * md->slot_sectors,
+			       sectors, ext);
+		if (r)
+			goto out_free;
+	}
+
+	r = dust_md_write_sb(md, dd->blksz, md->gen + 1, slot, nr, csum);
+	if (r)
+		goto out_free;
+
+	md->gen++;
+	md->slot = slot;
+	md->jpos = 0;
+	memset(md->jsect, 0, SECTOR_SIZE);
+out_free:
+	vfree(ext);
+out:
+	if (r) {
+		DMERR("metadata checkpoint failed: %d", r);
+		WRITE_ONCE(md->dirty, true);
+	}
+
+	return r;
+}
+
+/*
+ * Append an update from the message path to the journal.  When the
+ * journal has no room for it, the whole list is checkpointed instead.
+ * Called with the metadata lock held.
+ */
+static int dust_md_log(struct dust_device *dd, const struct dust_range *ranges,
+		       unsigned int nr, const struct dust_bb_op *op)
+{
+	struct dust_md *md = dd->md;
+	struct dust_md_entry *e;
+	unsigned long first, sectors, i;
+	void *buf;
+	int r;
+
+	if (md == NULL || !nr)
+		return 0;
+
+	if (md->jpos + nr > DUST_MD_JOURNAL_ENTRIES)
+		return dust_md_commit(dd);
+
+	first = md->jpos / DUST_MD_ENTRIES_PER_SECTOR;
+	sectors = (md->jpos + nr - 1) / DUST_MD_ENTRIES_PER_SECTOR - first + 1;
+	buf = kvzalloc(sectors * SECTOR_SIZE, GFP_KERNEL);
+	if (buf == NULL) {
+		dust_md_mark_dirty(dd);
+		return -ENOMEM;
+	}
+
+	memcpy(buf, md->jsect, SECTOR_SIZE);
+	e = (struct dust_md_entry *)buf + md->jpos % DUST_MD_ENTRIES_PER_SECTOR;
+	for (i = 0; i < nr; i++, e++) {
+		e->gen = cpu_to_le64(md->gen);
+		e->first = cpu_to_le64(ranges[i].first);
+		e->last = cpu_to_le64(ranges[i].last);
+		e->delay_us = cpu_to_le32(op->delay_us);
+		e->set = op->set;
+		e->clear = op->clear;
+		e->wr_fail_cnt = cpu_to_le32(op->wr_fail_cnt);
+		e->op_flags = (op->set_cnt ? DUST_MD_SET_CNT : 0) |
+			      (op->set_delay ? DUST_MD_SET_DELAY : 0);
+		e->csum = cpu_to_le32(crc32c(0, &e->gen,
+					     sizeof(*e) - sizeof(e->csum)));
+	}
+
+	r = dust_md_io(md, REQ_OP_WRITE, REQ_SYNC | REQ_FUA,
+		       DUST_MD_JOURNAL_START + first, sectors, buf);
+	if (r) {
+		DMERR("metadata journal write failed: %d", r);
+		dust_md_mark_dirty(dd);
+	} else {
+		md->jpos += nr;
+		if (md->jpos % DUST_MD_ENTRIES_PER_SECTOR)
+			memcpy(md->jsect, buf + (sectors - 1) * SECTOR_SIZE,
+			       SECTOR_SIZE);
+		else
+			memset(md->jsect, 0, SECTOR_SIZE);
+	}
+	kvfree(buf);
+
+	return r;
+}
+
+/*
+ * A position in a list of ranges: range i from block pos on.  The list
+ * is walked in pieces that each lie in one shard.
+ */
+struct dust_cursor {
+	const struct dust_range *ranges;
+	unsigned int nr;
+	unsigned int i;
+	sector_t pos;
+};
+
+static void dust_cursor_init(struct dust_cursor *c,
+			     const struct dust_range *ranges, unsigned int nr)
+{
+	c->ranges = ranges;
+	c->nr = nr;
+	c->i = 0;
+	c->pos = nr ? ranges[0].first : 0;
+}
+
+/*
+ * Return the shard of the next piece and the piece in first and last,
+ * and move past it.
+ */
+static struct dust_shard *dust_cursor_next(struct dust_device *dd,
+					   struct dust_cursor *c,
+					   sector_t *first, sector_t *last)
+{
+	struct dust_shard *sh = dust_shard(dd, c->pos);
+
+	*first = c->pos;
+	*last = min(c->ranges[c->i].last, dust_shard_last(sh));
+	if (*last == c->ranges[c->i].last) {
+		if (++c->i < c->nr)
+			c->pos = c->ranges[c->i].first;
+	} else
+		c->pos = *last + 1;
+
+	return sh;
+}
+
+/*
+ * Update a list of ranges from the message path, without journaling
+ * it.  The pieces of the ranges are applied in batches that each stay
+ * within one shard and run under its lock.  Extents are allocated with
+ * the lock dropped and counted again until enough are at hand for the
+ * next batch.  changed is set once any batch was applied.
+ */
+static int __dust_bb_update_ranges(struct dust_device *dd,
+				   const struct dust_range *ranges,
+				   unsigned int nr, const struct dust_bb_op *op,
+				   bool *changed)
+{
+	struct dust_cursor c, next;
+	unsigned int i, batch, needed;
+	struct dust_prealloc pa;
+	struct dust_shard *sh;
+	sector_t first, last;
+	unsigned long flags;
+	bool applied;
+	int r = 0;
+
+	dust_prealloc_init(&pa);
+	dust_cursor_init(&c, ranges, nr);
+	while (c.i < nr) {
+		sh = dust_shard(dd, c.pos);
+		needed = 0;
+		applied = false;
+
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		next = c;
+		for (batch = 0; batch < DUST_BULK_BATCH && next.i < nr &&
+		     dust_shard(dd, next.pos) == sh && !r; batch++) {
+			dust_cursor_next(dd, &next, &first, &last);
+			if (op->strict)
+				r = dust_bb_check(sh, first, last, op);
+			needed += dust_bb_nodes_needed(sh, first, last, op);
+		}
+		if (!r && needed <= pa.nr) {
+			for (i = 0; i < batch; i++) {
+				dust_cursor_next(dd, &c, &first, &last);
+				__dust_bb_update(sh, first, last, op, &pa);
+			}
+			applied = true;
+		}
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+		if (r)
+			break;
+
+		if (applied) {
+			*changed = true;
+			cond_resched();
+			continue;
+		}
+
+		r = dust_prealloc_fill(&pa, needed, GFP_KERNEL);
+		if (r)
+			break;
+	}
+	dust_prealloc_release(&pa);
+
+	return r;
+}
+
+static int dust_bb_update_ranges(struct dust_device *dd,
+				 const struct dust_range *ranges,
+				 unsigned int nr, const struct dust_bb_op *op)
+{
+	bool changed = false;
+	int r;
+
+	r = __dust_bb_update_ranges(dd, ranges, nr, op, &changed);
+	if (!r)
+		r = dust_md_log(dd, ranges, nr, op);
+	else if (changed)
+		dust_md_mark_dirty(dd);
+
+	return r;
+}
+
+static int dust_bb_update(struct dust_device *dd, sector_t first, sector_t last,
+			  const struct dust_bb_op *op)
+{
+	struct dust_range range = { .first = first, .last = last };
+
+	return dust_bb_update_ranges(dd, &range, 1, op);
+}
+
+static int dust_remove_block(struct dust_device *dd, unsigned long long block,
+			     bool mode)
+{
+	struct dust_bb_op op = {
+		.clear = dust_mode_flag(mode),
+		.strict = true,
+	};
+	int r;
+
+	r = dust_bb_update(dd, block, block, &op);
+	if (r == -ENOENT) {
+		if (!dd->quiet_mode) {
+			DMERR("%s: block %llu not found in badblocklist",
+			      __func__, block);
+		}
+		return -EINVAL;
+	}
+	if (r)
+		return r;
+
+	dust_event(dd, DUST_EV_REMOVE, op.clear, block, block, 0);
+
+	return 0;
+}
+
+static int dust_add_block(struct dust_device *dd, unsigned long long block,
+			  unsigned int wr_fail_cnt, bool mode)
+{
+	/*
+	 * The write fail count belongs to the read failure: it is the
+	 * number of writes a read bad block fails before a write heals it.
+	 */
+	struct dust_bb_op op = {
+		.set = dust_mode_flag(mode),
+		.set_cnt = mode == RD,
+		.wr_fail_cnt = wr_fail_cnt,
+		.strict = true,
+	};
+	int r;
+
+	r = dust_bb_update(dd, block, block, &op);
+	if (r == -EEXIST) {
+		if (!dd->quiet_mode) {
+			DMERR("%s: block %llu already in badblocklist",
+			      __func__, block);
+		}
+		return -EINVAL;
+	}
+	if (r) {
+		if (!dd->quiet_mode)
+			DMERR("%s: badblock allocation failed", __func__);
+		return r;
+	}
+
+	dust_event(dd, DUST_EV_ADD, op.set, block, block, wr_fail_cnt);
+
+	return 0;
+}
+
+static int dust_add_range(struct dust_device *dd, unsigned long long first,
+			  unsigned long long last, unsigned int wr_fail_cnt,
+			  bool mode)
+{
+	struct dust_bb_op op = {
+		.set = dust_mode_flag(mode),
+		.set_cnt = mode == RD,
+		.wr_fail_cnt = wr_fail_cnt,
+	};
+	int r;
+
+	r = dust_bb_update(dd, first, last, &op);
+	if (r) {
+		if (!dd->quiet_mode)
+			DMERR("%s: badblock allocation failed", __func__);
+		return r;
+	}
+
+	dust_event(dd, DUST_EV_ADD, op.set, first, last, wr_fail_cnt);
+
+	return 0;
+}
+
+/*
+ * Make every block of [first, last] slow by delay_us on top of the
+ * global delay.
+ */
+static int dust_add_slow_range(struct dust_device *dd, unsigned long long first,
+			       unsigned long long last, unsigned int delay_us)
+{
+	struct dust_bb_op op = {
+		.set = DUST_BB_SLOW,
+		.set_delay = true,
+		.delay_us = delay_us,
+	};
+	int r;
+
+	r = dust_bb_update(dd, first, last, &op);
+	if (r) {
+		if (!dd->quiet_mode)
+			DMERR("%s: badblock allocation failed", __func__);
+		return r;
+	}
+
+	dust_event(dd, DUST_EV_ADD, DUST_BB_SLOW, first, last, delay_us);
+
+	return 0;
+}
+
+/*
+ * Make reads of every block of [first, last] return corrupted data.
+ */
+static int dust_add_corrupt_range(struct dust_device *dd,
+				  unsigned long long first,
+				  unsigned long long last)
+{
+	struct dust_bb_op op = {
+		.set = DUST_BB_CORRUPT,
+	};
+	int r;
+
+	r = dust_bb_update(dd, first, last, &op);
+	if (r) {
+		if (!dd->quiet_mode)
+			DMERR("%s: badblock allocation failed", __func__);
+		return r;
+	}
+
+	dust_event(dd, DUST_EV_ADD, DUST_BB_CORRUPT, first, last, 0);
+
+	return 0;
+}
+
+static int dust_remove_range(struct dust_device *dd, unsigned long long first,
+			     unsigned long long last, unsigned char flag)
+{
+	struct dust_bb_op op = {
+		.clear = flag,
+	};
+	int r;
+
+	r = dust_bb_update(dd, first, last, &op);
+	if (r)
+		return r;
+
+	dust_event(dd, DUST_EV_REMOVE, flag, first, last, 0);
+
+	return 0;
+}
+
+static int dust_range_cmd_apply(struct dust_device *dd,
+				const struct dust_range_cmd *cmd)
+{
+	if (cmd->add && cmd->flag == DUST_BB_SLOW)
+		return dust_add_slow_range(dd, cmd->first, cmd->last, cmd->arg);
+
+	if (cmd->add && cmd->flag == DUST_BB_CORRUPT)
+		return dust_add_corrupt_range(dd, cmd->first, cmd->last);
+
+	if (cmd->add)
+		return dust_add_range(dd, cmd->first, cmd->last, cmd->arg,
+				      cmd->flag == DUST_BB_WRITE);
+
+	return dust_remove_range(dd, cmd->first, cmd->last, cmd->flag);
+}
+
+static void dust_sched_arm(struct dust_sched *s)
+{
+	hrtimer_start(&s->timer, ktime_add_ns(s->start, s->ents[s->pos].at_ns),
+		      HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart dust_sched_timer(struct hrtimer *timer)
+{
+	struct dust_sched *s = container_of(timer, struct dust_sched, timer);
+
+	queue_work(dust_wq, &s->work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Apply the changes that are due and wait for the next one.  A change
+ * that fails is skipped.
+ */
+static void dust_sched_work(struct work_struct *work)
+{
+	struct dust_device *dd = container_of(work, struct dust_device,
+					      sched.work);
+	struct dust_sched *s = &dd->sched;
+	u64 now;
+	int r;
+
+	if (dd->md)
+		mutex_lock(&dd->md->lock);
+	mutex_lock(&s->lock);
+	now = ktime_get_ns() - ktime_to_ns(s->start);
+	while (s->running && s->pos < s->nr && s->ents[s->pos].at_ns <= now) {
+		r = dust_range_cmd_apply(dd, &s->ents[s->pos].cmd);
+		if (r && !dd->quiet_mode)
+			DMERR("%s: schedule entry %u failed: %d", __func__,
+			      s->pos, r);
+		s->pos++;
+	}
+	if (s->pos == s->nr)
+		s->running = false;
+	else if (s->running)
+		dust_sched_arm(s);
+	mutex_unlock(&s->lock);
+	if (dd->md)
+		mutex_unlock(&dd->md->lock);
+}
+
+/*
+ * Stop the schedule.  The work may still be queued, but does nothing
+ * until the schedule is started again.  Messages hold the metadata lock
+ * the work takes, so only the destructor waits for it.
+ */
+static void dust_sched_stop(struct dust_sched *s)
+{
+	mutex_lock(&s->lock);
+	s->running = false;
+	mutex_unlock(&s->lock);
+	hrtimer_cancel(&s->timer);
+}
+
+static const char *dust_trig_names[DUST_TRIG_NR] = {
+	"reads", "writes", "bytes",
+};
+
+static inline void dust_trig_add(struct dust_triggers *t,
+				 enum dust_trig_kind kind, s64 amount,
+				 s32 batch)
+{
+	percpu_counter_add_batch(&t->count[kind], amount, batch);
+	if (percpu_counter_read(&t->count[kind]) >= READ_ONCE(t->next[kind]) &&
+	    !test_and_set_bit(DUST_TRIG_PENDING, &t->flags))
+		queue_work(dust_wq, &t->work);
+}
+
+/*
+ * Count a bio towards the triggers.  Discards and write zeroes count as
+ * writes but carry no bytes.
+ */
+static void dust_trig_account(struct dust_device *dd, struct bio *bio)
+{
+	struct dust_triggers *t = &dd->trig;
+
+	dust_trig_add(t, bio_data_dir(bio) == READ ? DUST_TRIG_READS :
+		      DUST_TRIG_WRITES, 1, DUST_TRIG_BATCH);
+	if (bio_has_data(bio))
+		dust_trig_add(t, DUST_TRIG_BYTES, bio->bi_iter.bi_size,
+			      DUST_TRIG_BYTES_BATCH);
+}
+
+/*
+ * Recompute the thresholds of the map path after the list changed.
+ */
+static void dust_trig_update_next(struct dust_triggers *t)
+{
+	struct dust_trigger *trig;
+	s64 next[DUST_TRIG_NR];
+	int i;
+
+	for (i = 0; i < DUST_TRIG_NR; i++)
+		next[i] = S64_MAX;
+	list_for_each_entry(trig, &t->list, list)
+		next[trig->kind] = min(next[trig->kind], trig->at);
+	for (i = 0; i < DUST_TRIG_NR; i++)
+		WRITE_ONCE(t->next[i], next[i]);
+	WRITE_ONCE(t->armed, t->nr > 0);
+}
+
+/*
+ * Make the changes of the triggers that are due.  A change that fails is
+ * dropped all the same.
+ */
+static void dust_trig_work(struct work_struct *work)
+{
+	struct dust_device *dd = container_of(work, struct dust_device,
+					      trig.work);
+	struct dust_triggers *t = &dd->trig;
+	struct dust_trigger *trig, *tmp;
+	s64 now[DUST_TRIG_NR];
+	int i, r;
+
+	if (dd->md)
+		mutex_lock(&dd->md->lock);
+	mutex_lock(&t->lock);
+	for (i = 0; i < DUST_TRIG_NR; i++)
+		now[i] = percpu_counter_sum(&t->count[i]);
+	list_for_each_entry_safe(trig, tmp, &t->list, list) {
+		if (now[trig->kind] < trig->at)
+			continue;
+		r = dust_range_cmd_apply(dd, &trig->cmd);
+		if (r && !dd->quiet_mode)
+			DMERR("%s: trigger after %lld %s failed: %d", __func__,
+			      trig->at, dust_trig_names[trig->kind], r);
+		list_del(&trig->list);
+		kfree(trig);
+		t->nr--;
+	}
+	dust_trig_update_next(t);
+	for (i = 0; i < DUST_TRIG_NR; i++)
+		if (t->next[i] != S64_MAX)
+			WRITE_ONCE(t->next[i],
+				   percpu_counter_read(&t->count[i]) +
+				   t->next[i] - now[i]);
+	smp_mb__before_atomic();
+	clear_bit(DUST_TRIG_PENDING, &t->flags);
+	mutex_unlock(&t->lock);
+	if (dd->md)
+		mutex_unlock(&dd->md->lock);
+}
+
+static void dust_trig_clear(struct dust_triggers *t)
+{
+	struct dust_trigger *trig, *tmp;
+
+	mutex_lock(&t->lock);
+	list_for_each_entry_safe(trig, tmp, &t->list, list) {
+		list_del(&trig->list);
+		kfree(trig);
+	}
+	t->nr = 0;
+	dust_trig_update_next(t);
+	mutex_unlock(&t->lock);
+}
+
+static int dust_trig_init(struct dust_triggers *t)
+{
+	int i, r;
+
+	mutex_init(&t->lock);
+	INIT_LIST_HEAD(&t->list);
+	t->nr = 0;
+	t->flags = 0;
+	INIT_WORK(&t->work, dust_trig_work);
+	for (i = 0; i < DUST_TRIG_NR; i++) {
+		r = percpu_counter_init(&t->count[i], 0, GFP_KERNEL);
+		if (r) {
+			while (i--)
+				percpu_counter_destroy(&t->count[i]);
+			return r;
+		}
+	}
+	dust_trig_update_next(t);
+
+	return 0;
+}
+
+static void dust_trig_destroy(struct dust_triggers *t)
+{
+	int i;
+
+	cancel_work_sync(&t->work);
+	dust_trig_clear(t);
+	for (i = 0; i < DUST_TRIG_NR; i++)
+		percpu_counter_destroy(&t->count[i]);
+}
+
+static int dust_query_block(struct dust_device *dd, unsigned long long block,
+			    bool mode, char *result, unsigned int maxlen)
+{
+	struct dust_shard *sh = dust_shard(dd, block);
+	struct badblock *bblock;
+	unsigned long flags;
+	unsigned int sz = 0;
+
+	spin_lock_irqsave(&sh->dust_lock, flags);
+	bblock = dust_rb_search(&sh->badblocklist, block);
+	if (bblock != NULL && (bblock->flags & dust_mode_flag(mode)))
+		DMEMIT("%llu found", block);
+	else
+		DMEMIT("%llu not found", block);
+	spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+	return 1;
+}
+
+static int dust_count_badblocks(struct dust_device *dd, unsigned char flag,
+				char *result, unsigned int maxlen)
+{
+	unsigned long long count = 0;
+	struct dust_shard *sh;
+	unsigned long flags;
+	unsigned int sz = 0;
+	unsigned int i;
+
+	for (i = 0; i < dd->bbl->nr_shards; i++) {
+		sh = &dd->bbl->shards[i];
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		count += dust_shard_count(sh, flag);
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+	}
+
+	if (flag == DUST_BB_SLOW)
+		DMEMIT("countbadblocks: %llu slow block(s) found", count);
+	else
+		DMEMIT("countbadblocks: %llu %s badblock(s) found", count,
+		       dust_flag_name(flag));
+
+	return 1;
+}
+
+/*
+ * listbadblocks <read|write|slow> [<start> [<limit>]]
+ *
+ * List the blocks from start on that are bad in the given mode, one
+ * block or first-last range per line, in the form addbadblocks takes.
+ * Adjacent extents are coalesced.  Output stops after limit ranges or
+ * when the result buffer is full, and a last line "next <block>" tells
+ * where to continue.
+ */
+static int dust_list_badblocks(struct dust_device *dd, unsigned char flag,
+			       sector_t start, unsigned long long limit,
+			       char *result, unsigned int maxlen)
+{
+	/*
+	 * Room for "<first>-<last>\n" and for the "next <block>" line.
+	 */
+	const unsigned int line = 2 * 20 + 2;
+	struct dust_shard *sh = dust_shard(dd, start);
+	struct badblock *bblk;
+	sector_t first = 0, last = 0;
+	unsigned long flags;
+	unsigned int sz = 0;
+	bool pending = false;
+
+	/*
+	 * A range is printed once the next extent does not continue it,
+	 * which may only show in the next shard.
+	 */
+	for (; sh < dd->bbl->shards + dd->bbl->nr_shards; sh++) {
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		bblk = dust_rb_lower_bound(&sh->badblocklist, start);
+		for (; bblk; bblk = dust_bb_next(bblk)) {
+			if (!(bblk->flags & flag))
+				continue;
+
+			if (pending && bblk->bb == last + 1) {
+				last = dust_bb_last(bblk);
+				continue;
+			}
+
+			if (pending) {
+				if (!limit || sz + 2 * line >= maxlen)
+					break;
+				if (first == last)
+					DMEMIT("%llu\n",
+					       (unsigned long long)first);
+				else
+					DMEMIT("%llu-%llu\n",
+					       (unsigned long long)first,
+					       (unsigned long long)last);
+				limit--;
+			}
+
+			first = max(bblk->bb, start);
+			last = dust_bb_last(bblk);
+			pending = true;
+		}
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+		if (bblk)
+			break;
+	}
+
+	if (pending) {
+		if (!limit || sz + 2 * line >= maxlen)
+			DMEMIT("next %llu\n", (unsigned long long)first);
+		else if (first == last)
+			DMEMIT("%llu\n", (unsigned long long)first);
+		else
+			DMEMIT("%llu-%llu\n", (unsigned long long)first,
+			       (unsigned long long)last);
+	}
+
+	return 1;
+}
+
+/*
+ * The blocks a remapped bio covers.
+ */
+static void dust_bio_blocks(struct dust_device *dd, struct bio *bio,
+			    sector_t *first, sector_t *last)
+{
+	*first = bio->bi_iter.bi_sector >> dd->sect_per_block_shift;
+	*last = (bio_end_sector(bio) - 1) >> dd->sect_per_block_shift;
+}
+
+/*
+ * Trim a bio that crosses the end of its shard, so that the map path
+ * only ever walks and locks one shard.  DM core submits the rest as a
+ * new bio.
+ */
+static void dust_shard_trim(struct dust_device *dd, struct bio *bio)
+{
+	sector_t first, last, end;
+
+	if (dd->bbl->nr_shards == 1)
+		return;
+
+	dust_bio_blocks(dd, bio, &first, &last);
+	end = dust_shard_last(dust_shard(dd, first));
+	if (last > end)
+		dm_accept_partial_bio(bio, ((end + 1) <<
+					    dd->sect_per_block_shift) -
+				      bio->bi_iter.bi_sector);
+}
+
+/*
+ * Bios are not split to the block size, so a bio may span several blocks.
+ * If the bio starts in front of the bad blocks [badblock, bad_last],
+ * shrink it to the healthy prefix and remap that in one piece; otherwise
+ * shrink it to the part inside the bad blocks and fail it.  DM core
+ * submits the remainder as a new bio.
+ */
+static int dust_split_at(struct dust_device *dd, struct bio *bio,
+			 sector_t badblock, sector_t bad_last)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t bad_start = badblock << dd->sect_per_block_shift;
+	sector_t bad_end = (bad_last + 1) << dd->sect_per_block_shift;
+
+	if (bad_start > sector) {
+		dm_accept_partial_bio(bio, bad_start - sector);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	if (bad_end - sector < bio_sectors(bio))
+		dm_accept_partial_bio(bio, bad_end - sector);
+	this_cpu_inc(dd->stats->bb_hits);
+
+	return DM_MAPIO_KILL;
+}
+
+/*
+ * splitmix64 of the seed and the block number, keyed by mode so reads
+ * and writes fail on different blocks.
+ */
+static u32 dust_rate_hash(u64 seed, bool mode, sector_t blk)
+{
+	u64 x = blk ^ (seed * 0x9e3779b97f4a7c15ULL) ^ ((u64)mode << 63);
+
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x >> 32;
+}
+
+/*
+ * Return the first block of [first, last] that fails randomly in mode,
+ * or last + 1.
+ */
+static sector_t dust_rate_cut(struct dust_device *dd, bool mode,
+			      sector_t first, sector_t last)
+{
+	u64 threshold = READ_ONCE(dd->fail_rate[mode].threshold);
+	struct rnd_state *state;
+	sector_t blk;
+	u64 seed;
+	u32 v;
+
+	if (!threshold)
+		return last + 1;
+
+	if (READ_ONCE(dd->fail_rate[mode].per_io)) {
+		state = get_cpu_ptr(dd->rnd_state);
+		v = prandom_u32_state(state);
+		put_cpu_ptr(dd->rnd_state);
+		return v < threshold ? first : last + 1;
+	}
+
+	seed = READ_ONCE(dd->rand_seed);
+	for (blk = first; blk <= last; blk++) {
+		if (dust_rate_hash(seed, mode, blk) < threshold)
+			return blk;
+	}
+
+	return last + 1;
+}
+
+/*
+ * Fail the bio if its first block fails randomly, or trim it in front
+ * of the first block that does and shrink last accordingly; DM core
+ * brings the rest back as a new bio.
+ */
+static int dust_map_rate(struct dust_device *dd, struct bio *bio, bool mode,
+			 sector_t first, sector_t *last)
+{
+	sector_t cut = dust_rate_cut(dd, mode, first, *last);
+
+	if (cut > *last)
+		return DM_MAPIO_REMAPPED;
+
+	if (cut == first)
+		return dust_split_at(dd, bio, cut, cut);
+
+	dm_accept_partial_bio(bio, (cut << dd->sect_per_block_shift) -
+			      bio->bi_iter.bi_sector);
+	*last = cut - 1;
+
+	return DM_MAPIO_REMAPPED;
+}
+
+static int __dust_map_read(struct dust_device *dd, struct bio *bio,
+			   sector_t first, sector_t last)
+{
+	struct badblock *bblk;
+	unsigned int depth;
+	int r = DM_MAPIO_REMAPPED;
+
+	/*
+	 * Every block of the extent fails, so all of it that the bio covers
+	 * is failed at once.
+	 */
+	bblk = dust_rb_range_rcu(dd, first, last, DUST_BB_READ, &depth);
+	if (bblk)
+		r = dust_split_at(dd, bio, max(bblk->bb, first),
+				  dust_bb_last(bblk));
+
+	trace_dust_map_read(bio, first, last,
+			    r == DM_MAPIO_KILL ? DUST_KILL : DUST_REMAP, depth);
+
+	return r;
+}
+
+static int dust_map_read(struct dust_device *dd, struct bio *bio,
+			 bool fail_read_on_bb)
+{
+	sector_t first, last;
+	int r = DM_MAPIO_REMAPPED;
+
+	if (fail_read_on_bb) {
+		dust_bio_blocks(dd, bio, &first, &last);
+		r = dust_map_rate(dd, bio, RD, first, &last);
+		if (r != DM_MAPIO_REMAPPED)
+			return r;
+		rcu_read_lock();
+		r = __dust_map_read(dd, bio, first, last);
+		rcu_read_unlock();
+	}
+
+	return r;
+}
+
+/*
+ * Update [first, last] of sh from the map path, where nothing may sleep.
+ * If the two extents a split may need cannot be allocated, the list is
+ * left as it is and -ENOMEM returned, so that the caller neither counts
+ * nor records an update that did not happen.
+ */
+static int dust_bb_update_atomic(struct dust_shard *sh, sector_t first,
+				 sector_t last, const struct dust_bb_op *op)
+{
+	struct dust_prealloc pa;
+	int r;
+
+	dust_prealloc_init(&pa);
+	r = dust_prealloc_fill(&pa, dust_bb_nodes_needed(sh, first, last, op),
+			       GFP_NOWAIT);
+	if (!r)
+		__dust_bb_update(sh, first, last, op, &pa);
+	dust_prealloc_release(&pa);
+
+	return r;
+}
+
+static int __dust_map_write(struct dust_device *dd, struct bio *bio,
+			    sector_t first, sector_t last,
+			    bool fail_read_on_bb, bool fail_write_on_bb)
+{
+	unsigned char mask = (fail_read_on_bb ? DUST_BB_READ : 0) |
+			     (fail_write_on_bb ? DUST_BB_WRITE : 0);
+	struct dust_bb_op heal = { .clear = DUST_BB_READ };
+	struct dust_bb_op isolate = { };
+	struct dust_shard *sh = dust_shard(dd, first);
+	enum dust_decision decision = DUST_KILL;
+	struct badblock *bblk;
+	unsigned long long healed;
+	unsigned long flags;
+	unsigned int depth, seq;
+	sector_t cut, bad_last;
+	int r = DM_MAPIO_REMAPPED, cnt;
+
+	/*
+	 * One lookup finds the first block the write cares about.  A write
+	 * failure wins over healing the same block.
+	 */
+	seq = read_seqcount_begin(&sh->dust_seq);
+	bblk = dust_rb_range_rcu(dd, first, last, mask, &depth);
+	if (!bblk) {
+		trace_dust_map_write(bio, first, last, DUST_REMAP, depth);
+		return DM_MAPIO_REMAPPED;
+	}
+	if (READ_ONCE(bblk->flags) & mask & DUST_BB_WRITE) {
+		r = dust_split_at(dd, bio, max(bblk->bb, first),
+				  dust_bb_last(bblk));
+		trace_dust_map_write(bio, first, last, r == DM_MAPIO_KILL ?
+				     DUST_KILL : DUST_REMAP, depth);
+		return r;
+	}
+
+	/*
+	 * Blocks in front of the first read bad block are passed on as they
+	 * are if that block fails the write; if it is healed, the locked
+	 * path heals it along with them in one piece.  A first block that is
+	 * an extent of its own consumes one of its write failures without
+	 * the lock.  The extent is only trusted if no update of the shard
+	 * ran since before the lookup found it, and the count is only
+	 * decremented if it still holds the value read then, so neither a
+	 * split nor a new count is missed.  An update that ran while the
+	 * count was decremented may have erased or replaced the extent, so
+	 * the failure is given back and the locked path decides.  Anything
+	 * else is left to the locked path as well.
+	 */
+	cnt = atomic_read(&bblk->wr_fail_cnt);
+	if (bblk->bb > first && cnt) {
+		r = dust_split_at(dd, bio, bblk->bb, bblk->bb);
+		trace_dust_map_write(bio, first, last, DUST_REMAP, depth);
+		return r;
+	}
+	if (READ_ONCE(bblk->bb) == first && READ_ONCE(bblk->len) == 1 &&
+	    cnt > 0 && !read_seqcount_retry(&sh->dust_seq, seq) &&
+	    atomic_cmpxchg(&bblk->wr_fail_cnt, cnt, cnt - 1) == cnt) {
+		if (!read_seqcount_retry(&sh->dust_seq, seq)) {
+			dust_md_mark_dirty(dd);
+			r = dust_split_at(dd, bio, first, first);
+			trace_dust_map_write(bio, first, last, DUST_CONSUME,
+					     depth);
+			return r;
+		}
+		atomic_inc(&bblk->wr_fail_cnt);
+	}
+
+	/*
+	 * Otherwise the block either consumes a write failure of a longer
+	 * extent, which must be split, or is healed by the write.  Both
+	 * modify the list, so walk it again under the lock of the shard,
+	 * which holds all of the bio.  Blocks in front of the first one that
+	 * still fails are healed, and the bio is cut there.  A failure is
+	 * consumed by splitting the block off and decrementing its own
+	 * count, which lockless writers may be decrementing as well; should
+	 * they have used it up meanwhile, the block is healed instead.
+	 * Without memory for a split, blocks are neither healed nor have a
+	 * failure consumed: the bio passes or fails as the list stands.
+	 */
+	spin_lock_irqsave(&sh->dust_lock, flags);
+retry:
+	cut = last + 1;
+	bad_last = last;
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first);
+	for (; bblk && bblk->bb <= last; bblk = dust_bb_next(bblk)) {
+		if ((bblk->flags & mask & DUST_BB_WRITE) ||
+		    ((bblk->flags & mask & DUST_BB_READ) &&
+		     atomic_read(&bblk->wr_fail_cnt))) {
+			cut = max(bblk->bb, first);
+			bad_last = bblk->flags & mask & DUST_BB_WRITE ?
+				   dust_bb_last(bblk) : cut;
+			break;
+		}
+	}
+
+	if (cut > first) {
+		healed = sh->badblock_count_read;
+		if (dust_bb_update_atomic(sh, first, cut - 1, &heal)) {
+			decision = DUST_REMAP;
+		} else {
+			dust_md_mark_dirty(dd);
+			this_cpu_add(dd->stats->blocks_healed,
+				     healed - sh->badblock_count_read);
+			decision = DUST_HEAL;
+		}
+	} else if (!(bblk->flags & mask & DUST_BB_WRITE) &&
+		   (bblk->len == 1 ||
+		    !dust_bb_update_atomic(sh, first, first, &isolate))) {
+		bblk = dust_rb_search(&sh->badblocklist, first);
+		if (bblk->len == 1 &&
+		    atomic_dec_if_positive(&bblk->wr_fail_cnt) < 0)
+			goto retry;
+		dust_md_mark_dirty(dd);
+		decision = DUST_CONSUME;
+	}
+
+	if (cut <= last)
+		r = dust_split_at(dd, bio, cut, bad_last);
+	spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+	if (decision == DUST_HEAL)
+		dust_event(dd, DUST_EV_HEAL, DUST_BB_READ, first, cut - 1, 0);
+	trace_dust_map_write(bio, first, last, decision, depth);
+
+	return r;
+}
+
+static int __dust_map_discard(struct dust_device *dd, struct bio *bio,
+			      sector_t first, sector_t last, unsigned char mask)
+{
+	struct dust_bb_op heal = { .clear = DUST_BB_READ };
+	struct dust_shard *sh = dust_shard(dd, first);
+	enum dust_decision decision = DUST_KILL;
+	struct badblock *bblk;
+	unsigned long long healed;
+	unsigned long flags;
+	unsigned int depth;
+	int r = DM_MAPIO_KILL;
+
+	bblk = dust_rb_range_rcu(dd, first, last, mask, &depth);
+	if (!bblk) {
+		trace_dust_map_write(bio, first, last, DUST_REMAP, depth);
+		return DM_MAPIO_REMAPPED;
+	}
+	if (dd->discard == DUST_DISCARD_FAIL ||
+	    (READ_ONCE(bblk->flags) & mask & DUST_BB_WRITE) ||
+	    atomic_read(&bblk->wr_fail_cnt))
+		goto out;
+
+	/*
+	 * Heal all of the range in one update unless a block further on
+	 * fails the bio anyway: a write bad one, or a read bad one with
+	 * write failures left, which a write would fail on too.  No
+	 * failure is consumed, as the bio is failed as a whole.  Without
+	 * memory to heal the range, the bio passes and the blocks stay bad.
+	 */
+	spin_lock_irqsave(&sh->dust_lock, flags);
+	bblk = dust_rb_lower_bound(&sh->badblocklist, first);
+	for (; bblk && bblk->bb <= last; bblk = dust_bb_next(bblk))
+		if ((bblk->flags & mask & DUST_BB_WRITE) ||
+		    ((bblk->flags & mask & DUST_BB_READ) &&
+		     atomic_read(&bblk->wr_fail_cnt)))
+			break;
+	if (!bblk || bblk->bb > last) {
+		healed = sh->badblock_count_read;
+		if (dust_bb_update_atomic(sh, first, last, &heal)) {
+			decision = DUST_REMAP;
+		} else {
+			dust_md_mark_dirty(dd);
+			this_cpu_add(dd->stats->blocks_healed,
+				     healed - sh->badblock_count_read);
+			decision = DUST_HEAL;
+		}
+		r = DM_MAPIO_REMAPPED;
+	}
+	spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+	if (decision == DUST_HEAL)
+		dust_event(dd, DUST_EV_HEAL, DUST_BB_READ, first, last, 0);
+out:
+	if (r == DM_MAPIO_KILL)
+		this_cpu_inc(dd->stats->bb_hits);
+	trace_dust_map_write(bio, first, last, decision, depth);
+
+	return r;
+}
+
+/*
+ * Discard and write zeroes bios are checked as one range and never cut
+ * at bad blocks, so a large one costs a single lookup.  Random failures
+ * do not apply to them.
+ */
+static int dust_map_discard(struct dust_device *dd, struct bio *bio,
+			    bool fail_read_on_bb, bool fail_write_on_bb)
+{
+	unsigned char mask = (fail_read_on_bb ? DUST_BB_READ : 0) |
+			     (fail_write_on_bb ? DUST_BB_WRITE : 0);
+	sector_t first, last;
+	int r;
+
+	if (!mask || dd->discard == DUST_DISCARD_IGNORE)
+		return DM_MAPIO_REMAPPED;
+
+	dust_bio_blocks(dd, bio, &first, &last);
+	rcu_read_lock();
+	r = __dust_map_discard(dd, bio, first, last, mask);
+	rcu_read_unlock();
+
+	return r;
+}
+
+static int dust_map_write(struct dust_device *dd, struct bio *bio,
+			  bool fail_read_on_bb, bool fail_write_on_bb)
+{
+	sector_t first, last;
+	int ret = DM_MAPIO_REMAPPED;
+
+	if (fail_read_on_bb || fail_write_on_bb) {
+		dust_bio_blocks(dd, bio, &first, &last);
+		if (fail_write_on_bb) {
+			ret = dust_map_rate(dd, bio, WR, first, &last);
+			if (ret != DM_MAPIO_REMAPPED)
+				return ret;
+		}
+		rcu_read_lock();
+		ret = __dust_map_write(dd, bio, first, last, fail_read_on_bb,
+				       fail_write_on_bb);
+		rcu_read_unlock();
+	}
+
+	return ret;
+}
+
+static void dust_delay_submit(struct dust_delay_queue *q, bool flush)
+{
+	struct bio_list bios;
+	struct dust_bio *db, *next;
+	struct bio *bio;
+	ktime_t now = ktime_get();
+
+	bio_list_init(&bios);
+	spin_lock_irq(&q->lock);
+	list_for_each_entry_safe(db, next, &q->bios, list) {
+		if (!flush && ktime_after(db->expires, now)) {
+			hrtimer_start(&q->timer, db->expires, HRTIMER_MODE_ABS);
+			break;
+		}
+		list_del(&db->list);
+		bio_list_add(&bios, dm_bio_from_per_bio_data(db, sizeof(*db)));
+	}
+	spin_unlock_irq(&q->lock);
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+static void dust_delay_work(struct work_struct *work)
+{
+	struct dust_delay_queue *q = container_of(work, struct dust_delay_queue,
+						  work);
+
+	dust_delay_submit(q, READ_ONCE(q->dd->delay_suspended));
+}
+
+static enum hrtimer_restart dust_delay_timer(struct hrtimer *timer)
+{
+	struct dust_delay_queue *q = container_of(timer,
+						  struct dust_delay_queue,
+						  timer);
+
+	queue_work(dust_delay_wq, &q->work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Queue a remapped bio for delay_us.  Delays are mostly alike, so the
+ * queue is searched from its tail for the insertion point.  The timer
+ * only moves when the bio becomes the first to expire.
+ */
+static void dust_delay_bio(struct dust_device *dd, struct bio *bio,
+			   unsigned int delay_us)
+{
+	struct dust_bio *db = dm_per_bio_data(bio, sizeof(*db));
+	struct dust_delay_queue *q = raw_cpu_ptr(dd->delay_queues);
+	struct dust_bio *pos;
+	unsigned long flags;
+
+	db->expires = ktime_add_us(ktime_get(), delay_us);
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_for_each_entry_reverse(pos, &q->bios, list) {
+		if (!ktime_after(pos->expires, db->expires))
+			break;
+	}
+	list_add(&db->list, &pos->list);
+	if (q->bios.next == &db->list)
+		hrtimer_start(&q->timer, db->expires, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/*
+ * A bio that is remapped after all waits for the global delay plus the
+ * delay of the first slow extent it touches, with a uniformly
+ * distributed jitter on top.  Bios are not delayed while the target is
+ * being suspended.
+ */
+static int dust_map_delay(struct dust_device *dd, struct bio *bio)
+{
+	unsigned int delay_us = READ_ONCE(dd->delay_us);
+	unsigned int jitter_us = READ_ONCE(dd->delay_jitter_us);
+	struct badblock *bblk;
+	sector_t first, last;
+	unsigned int depth;
+
+	if (READ_ONCE(dd->delay_suspended)) {
+		trace_dust_map(bio, DUST_REMAP);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	dust_bio_blocks(dd, bio, &first, &last);
+	rcu_read_lock();
+	bblk = dust_rb_range_rcu(dd, first, last, DUST_BB_SLOW, &depth);
+	if (bblk)
+		delay_us += READ_ONCE(bblk->delay_us);
+	rcu_read_unlock();
+
+	if (!delay_us) {
+		trace_dust_map(bio, DUST_REMAP);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	if (jitter_us)
+		delay_us += prandom_u32_max(jitter_us + 1);
+
+	trace_dust_map(bio, DUST_DELAY);
+	this_cpu_inc(dd->stats->bios_delayed);
+	dust_delay_bio(dd, bio, delay_us);
+
+	return DM_MAPIO_SUBMITTED;
+}
+
+static void dust_rate_seed(struct dust_device *dd, u64 seed)
+{
+	int cpu;
+
+	WRITE_ONCE(dd->rand_seed, seed);
+	for_each_possible_cpu(cpu)
+		prandom_seed_state(per_cpu_ptr(dd->rnd_state, cpu), seed + cpu);
+}
+
+/*
+ * Push out every delayed bio now, for suspend and for the destructor.
+ */
+static void dust_delay_flush(struct dust_device *dd)
+{
+	struct dust_delay_queue *q;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(dd->delay_queues, cpu);
+		hrtimer_cancel(&q->timer);
+		cancel_work_sync(&q->work);
+		dust_delay_submit(q, true);
+	}
+}
+
+/*
+ * Account a mapped bio.  The size is taken after the map path trimmed
+ * the bio to the part it actually remaps or fails.
+ */
+static void dust_stats_bio(struct dust_device *dd, struct bio *bio, int r)
+{
+	if (bio_data_dir(bio) == READ) {
+		if (r == DM_MAPIO_KILL)
+			this_cpu_inc(dd->stats->reads_failed);
+		else {
+			this_cpu_inc(dd->stats->reads_passed);
+			this_cpu_add(dd->stats->bytes_read,
+				     bio->bi_iter.bi_size);
+		}
+	} else {
+		if (r == DM_MAPIO_KILL)
+			this_cpu_inc(dd->stats->writes_failed);
+		else {
+			this_cpu_inc(dd->stats->writes_passed);
+			this_cpu_add(dd->stats->bytes_written,
+				     bio->bi_iter.bi_size);
+		}
+	}
+}
+
+static void dust_stats_sum(struct dust_device *dd, struct dust_stats *sum)
+{
+	struct dust_stats *s;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(dd->stats, cpu);
+		sum->reads_passed += s->reads_passed;
+		sum->reads_failed += s->reads_failed;
+		sum->writes_passed += s->writes_passed;
+		sum->writes_failed += s->writes_failed;
+		sum->bb_hits += s->bb_hits;
+		sum->blocks_healed += s->blocks_healed;
+		sum->bytes_read += s->bytes_read;
+		sum->bytes_written += s->bytes_written;
+		sum->bios_delayed += s->bios_delayed;
+		sum->blocks_corrupted += s->blocks_corrupted;
+	}
+}
+
+static void dust_stats_reset(struct dust_device *dd)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dd->stats, cpu), 0,
+		       sizeof(struct dust_stats));
+}
+
+static unsigned int dust_stats_emit(struct dust_device *dd, char *result,
+				    unsigned int sz, unsigned int maxlen)
+{
+	struct dust_stats sum;
+
+	dust_stats_sum(dd, &sum);
+	DMEMIT("read_passed=%llu read_failed=%llu write_passed=%llu "
+	       "write_failed=%llu bb_hits=%llu blocks_healed=%llu "
+	       "bytes_read=%llu bytes_written=%llu bios_delayed=%llu "
+	       "blocks_corrupted=%llu",
+	       sum.reads_passed, sum.reads_failed, sum.writes_passed,
+	       sum.writes_failed, sum.bb_hits, sum.blocks_healed,
+	       sum.bytes_read, sum.bytes_written, sum.bios_delayed,
+	       sum.blocks_corrupted);
+
+	return sz;
+}
+
+static const char * const dust_lat_names[DUST_LAT_NR] = {
+	[DUST_LAT_PASS] = "pass",
+	[DUST_LAT_HIT] = "hit",
+	[DUST_LAT_FAIL] = "fail",
+};
+
+/*
+ * Sort a timed bio into its histogram before it can complete: failed,
+ * or passed with or without blocks in the bad block list left.  The
+ * extra lookup is only made while the histograms are enabled.
+ */
+static void dust_lat_map(struct dust_device *dd, struct bio *bio,
+			 struct dust_bio *db, int r)
+{
+	sector_t first, last;
+	unsigned int depth;
+
+	if (!db->start_ns)
+		return;
+
+	if (r == DM_MAPIO_KILL) {
+		db->lat_kind = DUST_LAT_FAIL;
+		return;
+	}
+
+	dust_bio_blocks(dd, bio, &first, &last);
+	rcu_read_lock();
+	db->lat_kind = dust_rb_range_rcu(dd, first, last, DUST_BB_ALL, &depth) ?
+		       DUST_LAT_HIT : DUST_LAT_PASS;
+	rcu_read_unlock();
+}
+
+static void dust_lat_end(struct dust_device *dd, struct bio *bio,
+			 struct dust_bio *db)
+{
+	u64 ns = ktime_get_ns() - db->start_ns;
+	unsigned int b = min_t(unsigned int, fls64(ns), DUST_LAT_BUCKETS - 1);
+
+	this_cpu_inc(dd->lat->n[bio_data_dir(bio) == WRITE][db->lat_kind][b]);
+}
+
+static void dust_lat_reset(struct dust_device *dd)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dd->lat, cpu), 0, sizeof(struct dust_lat));
+}
+
+/*
+ * One line per direction and kind of bio that has been timed: the lower
+ * bound in ns of every bucket that holds bios and their number.
+ */
+static int dust_lat_emit(struct dust_device *dd, char *result,
+			 unsigned int maxlen)
+{
+	struct dust_lat *sum, *l;
+	unsigned int sz = 0;
+	int cpu, dir, kind, b;
+	u64 total;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		l = per_cpu_ptr(dd->lat, cpu);
+		for (dir = 0; dir < 2; dir++)
+			for (kind = 0; kind < DUST_LAT_NR; kind++)
+				for (b = 0; b < DUST_LAT_BUCKETS; b++)
+					sum->n[dir][kind][b] +=
+						l->n[dir][kind][b];
+	}
+
+	DMEMIT("%s", READ_ONCE(dd->lat_on) ? "enabled" : "disabled");
+	for (dir = 0; dir < 2; dir++) {
+		for (kind = 0; kind < DUST_LAT_NR; kind++) {
+			total = 0;
+			for (b = 0; b < DUST_LAT_BUCKETS; b++)
+				total += sum->n[dir][kind][b];
+			if (!total)
+				continue;
+
+			DMEMIT("\n%s %s %llu", dir ? "write" : "read",
+			       dust_lat_names[kind], total);
+			for (b = 0; b < DUST_LAT_BUCKETS; b++)
+				if (sum->n[dir][kind][b])
+					DMEMIT(" %llu:%llu",
+					       b ? 1ULL << (b - 1) : 0ULL,
+					       sum->n[dir][kind][b]);
+		}
+	}
+	kfree(sum);
+
+	return 1;
+}
+
+/*
+ * events
+ *
+ * Read out the events recorded since the last call, one per line:
+ * time in ns, CPU, event, mode, first and last block and the argument.
+ * Events come CPU by CPU, each CPU in order; sort by time to merge them.
+ * A CPU that recorded more events than its ring holds reports the
+ * number lost.  When the result buffer fills up, a last line "more"
+ * asks to call again.
+ */
+static int dust_events_emit(struct dust_device *dd, char *result,
+			    unsigned int maxlen)
+{
+	/*
+	 * Room for an event line and for the "more" line.
+	 */
+	const unsigned int line = 128;
+	struct dust_event_ring *ring;
+	struct dust_event e;
+	unsigned long head, lost;
+	unsigned int sz = 0;
+	unsigned int seq;
+	bool more = false;
+	int cpu;
+
+	mutex_lock(&dd->event_lock);
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(dd->events, cpu);
+		lost = 0;
+		while (ring->tail != READ_ONCE(ring->head)) {
+			if (sz + 2 * line >= maxlen) {
+				more = true;
+				break;
+			}
+
+			do {
+				seq = read_seqcount_begin(&ring->seq);
+				e = ring->ev[ring->tail % DUST_EVENTS];
+				head = ring->head;
+			} while (read_seqcount_retry(&ring->seq, seq));
+
+			/*
+			 * The entry was overwritten before it was read.
+			 */
+			if (head - ring->tail > DUST_EVENTS) {
+				lost += head - ring->tail - DUST_EVENTS;
+				ring->tail = head - DUST_EVENTS;
+				continue;
+			}
+			ring->tail++;
+
+			DMEMIT("%llu %d %s %s %llu %llu %u\n", e.time_ns, cpu,
+			       dust_event_names[e.type], dust_flag_name(e.flag),
+			       e.first, e.last, e.arg);
+		}
+		if (lost)
+			DMEMIT("lost %d %lu\n", cpu, lost);
+		if (more) {
+			DMEMIT("more\n");
+			break;
+		}
+	}
+	mutex_unlock(&dd->event_lock);
+
+	return 1;
+}
+
+/*
+ * Remember the extent of a read that covers corrupt blocks for
+ * dust_end_io().
+ */
+static void dust_map_corrupt(struct dust_device *dd, struct bio *bio,
+			     struct dust_bio *db)
+{
+	sector_t first, last;
+	unsigned int depth;
+
+	dust_bio_blocks(dd, bio, &first, &last);
+	rcu_read_lock();
+	if (dust_rb_range_rcu(dd, first, last, DUST_BB_CORRUPT, &depth)) {
+		db->iter = bio->bi_iter;
+		db->corrupt = true;
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * XOR the byte at corrupt_offset of every corrupt block a read covers
+ * with corrupt_xor, in place in the pages of the bio.  iter is the
+ * extent of the bio as it was submitted.  Runs in the completion context
+ * of the read, so the pages are mapped atomically, one byte at a time.
+ */
+static void dust_corrupt_bio(struct dust_device *dd, struct bio *bio,
+			     struct bvec_iter start)
+{
+	int shift = dd->sect_per_block_shift + SECTOR_SHIFT;
+	unsigned int offset = READ_ONCE(dd->corrupt_offset);
+	u8 xor = READ_ONCE(dd->corrupt_xor);
+	sector_t blk, last, bad = 0, bad_last = 0;
+	struct badblock *bblk;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	unsigned int depth;
+	u64 pos, at, n = 0;
+	bool found = false;
+	u8 *p;
+
+	pos = (u64)start.bi_sector << SECTOR_SHIFT;
+	last = (pos + start.bi_size - 1) >> shift;
+
+	rcu_read_lock();
+	__bio_for_each_segment(bv, bio, iter, start) {
+		blk = pos >> shift;
+		if (((u64)blk << shift) + offset < pos)
+			blk++;
+
+		for (; (at = ((u64)blk << shift) + offset) < pos + bv.bv_len;
+		     blk++) {
+			if (!found || blk > bad_last) {
+				bblk = dust_rb_range_rcu(dd, blk, last,
+							 DUST_BB_CORRUPT,
+							 &depth);
+				if (!bblk)
+					goto out;
+				bad = max(bblk->bb, blk);
+				bad_last = dust_bb_last(bblk);
+				found = true;
+			}
+			if (blk < bad) {
+				blk = bad - 1;
+				continue;
+			}
+
+			p = kmap_atomic(bv.bv_page);
+			p[bv.bv_offset + (at - pos)] ^= xor;
+			kunmap_atomic(p);
+			flush_dcache_page(bv.bv_page);
+			n++;
+		}
+		pos += bv.bv_len;
+	}
+out:
+	rcu_read_unlock();
+
+	this_cpu_add(dd->stats->blocks_corrupted, n);
+}
+
+static int dust_end_io(struct dm_target *ti, struct bio *bio,
+		       blk_status_t *error)
+{
+	struct dust_device *dd = ti->private;
+	struct dust_bio *db = dm_per_bio_data(bio, sizeof(*db));
+
+	if (db->corrupt && *error == BLK_STS_OK)
+		dust_corrupt_bio(dd, bio, db->iter);
+
+	if (db->start_ns)
+		dust_lat_end(dd, bio, db);
+
+	return DM_ENDIO_DONE;
+}
+
+static int dust_map(struct dm_target *ti, struct bio *bio)
+{
+	struct dust_device *dd = ti->private;
+	struct dust_bio *db = dm_per_bio_data(bio, sizeof(*db));
+	bool fail_read_on_bb, fail_write_on_bb;
+	sector_t first, last;
+	int r;
+
+	bio_set_dev(bio, dd->dev->bdev);
+	bio->bi_iter.bi_sector = dd->start + dm_target_offset(ti, bio->bi_iter.bi_sector);
+	db->corrupt = false;
+	db->start_ns = 0;
+
+	/*
+	 * Empty flushes carry no blocks to check.
+	 */
+	if (!bio_sectors(bio))
+		return DM_MAPIO_REMAPPED;
+
+	if (READ_ONCE(dd->lat_on))
+		db->start_ns = ktime_get_ns();
+
+	if (READ_ONCE(dd->trig.armed))
+		dust_trig_account(dd, bio);
+
+	/*
+	 * Nothing to check while no target injects failures.
+	 */
+	if (!static_branch_unlikely(&dust_fail_key)) {
+		r = DM_MAPIO_REMAPPED;
+		goto out;
+	}
+
+	fail_read_on_bb = READ_ONCE(dd->fail_read_on_bb);
+	fail_write_on_bb = READ_ONCE(dd->fail_write_on_bb);
+
+	/*
+	 * Nor while this target injects nothing, where bios are not even
+	 * cut at shard boundaries.
+	 */
+	if (!fail_read_on_bb && !fail_write_on_bb &&
+	    !READ_ONCE(dd->delay_on_bb) && !READ_ONCE(dd->corrupt_on_bb)) {
+		r = DM_MAPIO_REMAPPED;
+		goto out;
+	}
+
+	dust_shard_trim(dd, bio);
+	if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		r = dust_map_discard(dd, bio, fail_read_on_bb,
+				     fail_write_on_bb);
+	else if (bio_data_dir(bio) == READ)
+		r = dust_map_read(dd, bio, fail_read_on_bb);
+	else
+		r = dust_map_write(dd, bio, fail_read_on_bb, fail_write_on_bb);
+
+	/*
+	 * Failed bios are completed here with the configured status rather
+	 * than killed, which always fails them with BLK_STS_IOERR.
+	 */
+	if (r == DM_MAPIO_KILL) {
+		dust_bio_blocks(dd, bio, &first, &last);
+		dust_event(dd, DUST_EV_KILL, bio_data_dir(bio) == READ ?
+			   DUST_BB_READ : DUST_BB_WRITE, first, last, 0);
+		dust_stats_bio(dd, bio, r);
+		dust_lat_map(dd, bio, db, r);
+		trace_dust_map(bio, DUST_KILL);
+		bio->bi_status = READ_ONCE(dd->error_status);
+		bio_endio(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (r == DM_MAPIO_REMAPPED && bio_op(bio) == REQ_OP_READ &&
+	    READ_ONCE(dd->corrupt_on_bb))
+		dust_map_corrupt(dd, bio, db);
+
+	/*
+	 * A delayed bio may complete before dust_map_delay() returns, so it
+	 * is accounted first, and traced there.
+	 */
+	if (r == DM_MAPIO_REMAPPED && READ_ONCE(dd->delay_on_bb)) {
+		dust_stats_bio(dd, bio, r);
+		dust_lat_map(dd, bio, db, r);
+		return dust_map_delay(dd, bio);
+	}
+
+out:
+	dust_stats_bio(dd, bio, r);
+	dust_lat_map(dd, bio, db, r);
+	trace_dust_map(bio, DUST_REMAP);
+
+	return r;
+}
+
+static bool dust_faults_enabled(struct dust_device *dd)
+{
+	return dd->fail_read_on_bb || dd->fail_write_on_bb || dd->delay_on_bb ||
+	       dd->corrupt_on_bb;
+}
+
+/*
+ * The static key counts the targets that have failures in either
+ * direction, delays or corruption enabled.  mode is one of the four
+ * switches in dd.
+ */
+static void dust_set_fail_mode(struct dust_device *dd, bool *mode, bool enable)
+{
+	bool was_enabled, is_enabled;
+
+	mutex_lock(&dust_fail_mode_lock);
+	was_enabled = dust_faults_enabled(dd);
+	WRITE_ONCE(*mode, enable);
+	is_enabled = dust_faults_enabled(dd);
+
+	if (is_enabled && !was_enabled)
+		static_branch_inc(&dust_fail_key);
+	else if (!is_enabled && was_enabled)
+		static_branch_dec(&dust_fail_key);
+	mutex_unlock(&dust_fail_mode_lock);
+}
+
+/*
+ * Free a tree nobody looks at any more.  It is walked bottom up, so no
+ * extent is erased and nothing is rebalanced.
+ */
+static bool __dust_clear_badblocks(struct rb_root *tree)
+{
+	struct badblock *bblk, *next;
+	unsigned long nr = 0;
+
+	if (RB_EMPTY_ROOT(tree))
+		return false;
+
+	rbtree_postorder_for_each_entry_safe(bblk, next, tree, node) {
+		dust_bb_free(bblk);
+		if (!(++nr % DUST_BULK_BATCH))
+			cond_resched();
+	}
+	*tree = RB_ROOT;
+
+	return true;
+}
+
+static void dust_reap_work(struct work_struct *work)
+{
+	struct dust_reaper *reaper = container_of(work, struct dust_reaper,
+						  work);
+
+	/*
+	 * Lockless readers may still be walking the detached tree.
+	 */
+	synchronize_rcu();
+	__dust_clear_badblocks(&reaper->tree);
+	kfree(reaper);
+}
+
+/*
+ * Hand a detached tree over to dust_wq.  Frees it synchronously if even
+ * that small allocation fails.
+ */
+static void dust_reap_badblocks(struct rb_root *tree)
+{
+	struct dust_reaper *reaper;
+
+	if (RB_EMPTY_ROOT(tree))
+		return;
+
+	reaper = kmalloc(sizeof(*reaper), GFP_KERNEL);
+	if (reaper == NULL) {
+		synchronize_rcu();
+		__dust_clear_badblocks(tree);
+		return;
+	}
+
+	reaper->tree = *tree;
+	*tree = RB_ROOT;
+	INIT_WORK(&reaper->work, dust_reap_work);
+	queue_work(dust_wq, &reaper->work);
+}
+
+/*
+ * Clear flag on every block of sh and return the number of blocks it
+ * was set on.
+ */
+static unsigned long long dust_shard_clear(struct dust_shard *sh,
+					   unsigned char flag)
+{
+	struct dust_bb_op op = { .clear = flag };
+	struct rb_root badblocklist = RB_ROOT;
+	struct badblock *bblk, *next;
+	unsigned long long count, other;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sh->dust_lock, flags);
+	count = dust_shard_count(sh, flag);
+	other = sh->badblock_count_read + sh->badblock_count_write +
+		sh->badblock_count_slow + sh->badblock_count_corrupt - count;
+	if (count) {
+		write_seqcount_begin(&sh->dust_seq);
+		if (!other) {
+			/*
+			 * No block is in any other mode, so the whole tree
+			 * goes.
+			 */
+			badblocklist = sh->badblocklist;
+			sh->badblocklist = RB_ROOT;
+			sh->badblock_count_read = 0;
+			sh->badblock_count_write = 0;
+			sh->badblock_count_slow = 0;
+			sh->badblock_count_corrupt = 0;
+		} else {
+			bblk = rb_entry_safe(rb_first(&sh->badblocklist),
+					     struct badblock, node);
+			for (; bblk; bblk = next) {
+				next = dust_bb_next(bblk);
+				dust_bb_apply(sh, bblk, &op);
+			}
+			/*
+			 * Extents that only differed in flag are equal now.
+			 */
+			dust_bb_merge(sh, dust_shard_first(sh),
+				      dust_shard_last(sh));
+		}
+		write_seqcount_end(&sh->dust_seq);
+		dust_index_update(sh, flag & DUST_BB_READ);
+		dust_filter_refresh(sh, dust_shard_first(sh),
+				    dust_shard_last(sh));
+	}
+	spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+	dust_reap_badblocks(&badblocklist);
+
+	return count;
+}
+
+static int dust_clear_badblocks(struct dust_device *dd, unsigned char flag)
+{
+	struct dust_range all = { .first = 0, .last = (sector_t)-1 };
+	struct dust_bb_op op = { .clear = flag };
+	unsigned long long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < dd->bbl->nr_shards; i++)
+		count += dust_shard_clear(&dd->bbl->shards[i], flag);
+
+	if (!count)
+		DMINFO("%s: no %s badblocks found", __func__,
+		       dust_flag_name(flag));
+	else
+		DMINFO("%s: %s badblocks cleared", __func__,
+		       dust_flag_name(flag));
+
+	/*
+	 * Journaled as clearing the flag on every block.
+	 */
+	return count ? dust_md_log(dd, &all, 1, &op) : 0;
+}
+
+static int dust_range_cmp(const void *a, const void *b)
+{
+	const struct dust_range *ra = a, *rb = b;
+
+	if (ra->first < rb->first)
+		return -1;
+
+	return ra->first > rb->first;
+}
+
+/*
+ * Sort ranges and coalesce the ones that overlap or touch.  Returns the
+ * number of ranges left.
+ */
+static unsigned int dust_ranges_normalize(struct dust_range *ranges,
+					  unsigned int nr)
+{
+	unsigned int i, n = 0;
+
+	if (!nr)
+		return 0;
+
+	sort(ranges, nr, sizeof(*ranges), dust_range_cmp, NULL);
+	for (i = 1; i < nr; i++) {
+		if (ranges[i].first <= ranges[n].last + 1)
+			ranges[n].last = max(ranges[n].last, ranges[i].last);
+		else
+			ranges[++n] = ranges[i];
+	}
+
+	return n + 1;
+}
+
+/*
+ * Build a tree of new extents for sh from sorted, disjoint ranges, cut
+ * to the blocks of the shard, and count the blocks in it.  Every extent
+ * is larger than all before it, so it is always linked as the right
+ * child of the previous one.
+ */
+static int dust_bb_build(struct dust_shard *sh, struct rb_root *root,
+			 const struct dust_range *ranges, unsigned int nr,
+			 const struct dust_bb_op *op, unsigned long long *count)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct badblock *new;
+	unsigned int i;
+
+	*count = 0;
+	for (i = 0; i < nr; i++) {
+		new = kmem_cache_alloc(badblock_cache, GFP_KERNEL);
+		if (new == NULL) {
+			__dust_clear_badblocks(root);
+			return -ENOMEM;
+		}
+
+		new->bb = max(ranges[i].first, dust_shard_first(sh));
+		new->len = min(ranges[i].last, dust_shard_last(sh)) -
+			   new->bb + 1;
+		*count += new->len;
+		new->flags = op->set;
+		atomic_set(&new->wr_fail_cnt,
+			   op->set_cnt ? op->wr_fail_cnt : 0);
+		new->delay_us = op->set_delay ? op->delay_us : 0;
+		rb_link_node(&new->node, parent, link);
+		rb_insert_color(&new->node, root);
+		parent = &new->node;
+		link = &new->node.rb_right;
+
+		if (!(i % DUST_BULK_BATCH))
+			cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Load the sorted, disjoint ranges that overlap an empty shard: build
+ * its tree without holding the lock and publish it with a single root
+ * swap.  published is cleared if the shard is no longer empty by then.
+ */
+static int dust_bb_publish(struct dust_shard *sh,
+			   const struct dust_range *ranges, unsigned int nr,
+			   const struct dust_bb_op *op, bool *published)
+{
+	struct dust_filter *f = &sh->bbl->filter;
+	sector_t first = dust_shard_first(sh), last = dust_shard_last(sh);
+	struct rb_root tree = RB_ROOT;
+	unsigned long long count;
+	unsigned long flags;
+	unsigned int i, j, batch;
+	int r;
+
+	r = dust_bb_build(sh, &tree, ranges, nr, op, &count);
+	if (r)
+		return r;
+
+	/*
+	 * The filter bits go in first and in batches.  Should the shard no
+	 * longer be empty below, they only cost a few extra tree walks.
+	 */
+	for (i = 0; i < nr; i += batch) {
+		batch = min_t(unsigned int, nr - i, DUST_BULK_BATCH);
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		for (j = i; j < i + batch; j++)
+			dust_filter_set(f, max(ranges[j].first, first),
+					min(ranges[j].last, last));
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+	}
+
+	*published = false;
+	spin_lock_irqsave(&sh->dust_lock, flags);
+	if (RB_EMPTY_ROOT(&sh->badblocklist)) {
+		write_seqcount_begin(&sh->dust_seq);
+		sh->badblocklist = tree;
+		write_seqcount_end(&sh->dust_seq);
+		dust_index_update(sh, op->set & DUST_BB_READ);
+		if (op->set & DUST_BB_READ)
+			sh->badblock_count_read = count;
+		else
+			sh->badblock_count_write = count;
+		*published = true;
+	}
+	spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+	if (!*published)
+		__dust_clear_badblocks(&tree);
+
+	return 0;
+}
+
+/*
+ * Add or remove sorted, disjoint ranges.  Shards that are empty are
+ * loaded with dust_bb_publish(); in the others the ranges are applied in
+ * batches.  A range across shards is applied to each of them, the
+ * publishing shard included, which changes nothing there.
+ */
+static int dust_bb_bulk(struct dust_device *dd, const struct dust_range *ranges,
+			unsigned int nr, const struct dust_bb_op *op)
+{
+	unsigned int i, lo = 0, hi;
+	struct dust_shard *sh;
+	bool changed = false, published;
+	int r = 0;
+
+	if (!op->set)
+		return dust_bb_update_ranges(dd, ranges, nr, op);
+
+	for (i = 0; i < dd->bbl->nr_shards && lo < nr && !r; i++) {
+		sh = &dd->bbl->shards[i];
+		while (lo < nr && ranges[lo].last < dust_shard_first(sh))
+			lo++;
+		for (hi = lo;
+		     hi < nr && ranges[hi].first <= dust_shard_last(sh); hi++)
+			;
+		if (hi == lo)
+			continue;
+
+		published = false;
+		if (RB_EMPTY_ROOT(&sh->badblocklist))
+			r = dust_bb_publish(sh, ranges + lo, hi - lo, op,
+					    &published);
+		if (!r && !published)
+			r = __dust_bb_update_ranges(dd, ranges + lo, hi - lo,
+						    op, &changed);
+		if (published)
+			changed = true;
+
+		/*
+		 * The last range may go on into the next shard.
+		 */
+		lo = hi - 1;
+	}
+
+	if (!r)
+		r = dust_md_log(dd, ranges, nr, op);
+	else if (changed)
+		dust_md_mark_dirty(dd);
+
+	return r;
+}
+
+/*
+ * Turn a block list file of little endian 64-bit block numbers into
+ * ranges.
+ */
+static int dust_load_ranges(const char *path, sector_t size,
+			    struct dust_range **ranges, unsigned int *nr)
+{
+	void *buf = NULL;
+	loff_t buf_size;
+	__le64 *blocks;
+	unsigned int i, n;
+	int r;
+
+	r = kernel_read_file_from_path(path, &buf, &buf_size,
+				       DUST_BULK_MAX_SIZE, READING_UNKNOWN);
+	if (r < 0) {
+		DMERR("cannot read block list %s: %d", path, r);
+		return r;
+	}
+
+	if (!buf_size || buf_size % sizeof(*blocks)) {
+		DMERR("block list %s has an invalid size", path);
+		r = -EINVAL;
+		goto out;
+	}
+
+	blocks = buf;
+	n = buf_size / sizeof(*blocks);
+	*ranges = kvmalloc_array(n, sizeof(**ranges), GFP_KERNEL);
+	if (*ranges == NULL) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		(*ranges)[i].first = le64_to_cpu(blocks[i]);
+		(*ranges)[i].last = (*ranges)[i].first;
+		if ((*ranges)[i].first > size) {
+			DMERR("selected block value out of range");
+			kvfree(*ranges);
+			*ranges = NULL;
+			r = -EINVAL;
+			goto out;
+		}
+	}
+	*nr = n;
+	r = 0;
+out:
+	vfree(buf);
+
+	return r;
+}
+
+/*
+ * Trees built from an extent array for a list whose shards are not
+ * touched until the trees are published: one per shard with the blocks
+ * in each mode, and the filter bits of all of them.
+ */
+struct dust_build_shard {
+	struct rb_root root;
+	unsigned long long count_read;
+	unsigned long long count_write;
+	unsigned long long count_slow;
+	unsigned long long count_corrupt;
+};
+
+struct dust_build {
+	unsigned long *bits;
+	struct dust_build_shard shards[];
+};
+
+static void dust_build_free(struct dust_bblist *bbl, struct dust_build *b)
+{
+	unsigned int i;
+
+	if (b == NULL)
+		return;
+
+	for (i = 0; i < bbl->nr_shards; i++)
+		__dust_clear_badblocks(&b->shards[i].root);
+	kvfree(b->bits);
+	kvfree(b);
+}
+
+/*
+ * Build the trees of bbl from sorted, disjoint extents.  The extents may
+ * come from a list with other shards, so they are cut at shard
+ * boundaries again.  Every extent of a shard is larger than all before
+ * it and is linked as the right child of the previous one.
+ */
+static int dust_build(struct dust_bblist *bbl, const struct dust_md_extent *ext,
+		      u64 nr, struct dust_build **bp)
+{
+	struct rb_node **link = NULL, *parent = NULL;
+	struct dust_filter f = bbl->filter;
+	struct dust_build_shard *bs = NULL;
+	struct dust_build *b;
+	struct badblock *new;
+	sector_t bb, last, next = 0;
+	unsigned int i;
+	u64 j;
+	int r = 0;
+
+	b = kvzalloc(struct_size(b, shards, bbl->nr_shards), GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+
+	b->bits = kvzalloc(BITS_TO_LONGS(f.nr) * sizeof(unsigned long),
+			   GFP_KERNEL);
+	if (b->bits == NULL) {
+		kvfree(b);
+		return -ENOMEM;
+	}
+	f.bits = b->bits;
+
+	for (j = 0; j < nr && !r; j++) {
+		bb = le64_to_cpu(ext[j].bb);
+		last = bb + le64_to_cpu(ext[j].len) - 1;
+		if (last < bb || bb < next || !ext[j].flags ||
+		    (ext[j].flags & ~DUST_BB_ALL) ||
+		    le32_to_cpu(ext[j].wr_fail_cnt) > DUST_MAX_WR_FAIL_CNT) {
+			r = -EINVAL;
+			break;
+		}
+		next = last + 1;
+
+		for (; bb <= last; bb += new->len) {
+			i = min_t(sector_t, bb >> bbl->shard_shift,
+				  bbl->nr_shards - 1);
+			if (bs != &b->shards[i]) {
+				bs = &b->shards[i];
+				parent = NULL;
+				link = &bs->root.rb_node;
+			}
+
+			new = kmem_cache_alloc(badblock_cache, GFP_KERNEL);
+			if (new == NULL) {
+				r = -ENOMEM;
+				break;
+			}
+
+			new->bb = bb;
+			new->len = min(last, dust_shard_last(&bbl->shards[i])) -
+				   bb + 1;
+			new->flags = ext[j].flags;
+			atomic_set(&new->wr_fail_cnt,
+				   le32_to_cpu(ext[j].wr_fail_cnt));
+			new->delay_us = le32_to_cpu(ext[j].delay_us);
+			rb_link_node(&new->node, parent, link);
+			rb_insert_color(&new->node, &bs->root);
+			parent = &new->node;
+			link = &new->node.rb_right;
+
+			if (new->flags & DUST_BB_READ)
+				bs->count_read += new->len;
+			if (new->flags & DUST_BB_WRITE)
+				bs->count_write += new->len;
+			if (new->flags & DUST_BB_SLOW)
+				bs->count_slow += new->len;
+			if (new->flags & DUST_BB_CORRUPT)
+				bs->count_corrupt += new->len;
+			dust_filter_set(&f, bb, dust_bb_last(new));
+			if (dust_bb_last(new) == (sector_t)-1)
+				break;
+		}
+
+		if (!(j % DUST_BULK_BATCH))
+			cond_resched();
+	}
+
+	if (r) {
+		dust_build_free(bbl, b);
+		return r;
+	}
+	*bp = b;
+
+	return 0;
+}
+
+/*
+ * The words of the filter bitmap that belong to sh, as shards start on
+ * a word: [*w0, *w1), empty for a shard past the end of the bitmap.
+ */
+static void dust_filter_words(struct dust_shard *sh, unsigned long *w0,
+			      unsigned long *w1)
+{
+	struct dust_filter *f = &sh->bbl->filter;
+	unsigned long words = BITS_TO_LONGS(f->nr);
+
+	*w0 = min_t(sector_t,
+		    (dust_shard_first(sh) >> f->shift) / BITS_PER_LONG, words);
+	*w1 = min_t(sector_t,
+		    (dust_shard_last(sh) >> f->shift) / BITS_PER_LONG + 1,
+		    words);
+}
+
+/*
+ * Swap the trees and filter bits of b in, one root swap per shard, and
+ * free what they replace.  The filter bits of both lists are set while
+ * the root is swapped, so no lookup misses an extent of either.  Lookups
+ * see the whole old or the whole new tree of a shard, and since bios
+ * never cross a shard, each bio sees one list or the other.  Nothing is
+ * allocated or walked under the lock.
+ */
+static void dust_build_publish(struct dust_bblist *bbl, struct dust_build *b)
+{
+	unsigned long *bits = bbl->filter.bits;
+	struct dust_build_shard *bs;
+	struct dust_shard *sh;
+	unsigned long flags, w, w0, w1;
+	unsigned int i;
+
+	for (i = 0; i < bbl->nr_shards; i++) {
+		sh = &bbl->shards[i];
+		bs = &b->shards[i];
+		dust_filter_words(sh, &w0, &w1);
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		for (w = w0; w < w1; w++)
+			WRITE_ONCE(bits[w], bits[w] | b->bits[w]);
+		write_seqcount_begin(&sh->dust_seq);
+		swap(sh->badblocklist, bs->root);
+		write_seqcount_end(&sh->dust_seq);
+		for (w = w0; w < w1; w++)
+			WRITE_ONCE(bits[w], b->bits[w]);
+		swap(sh->badblock_count_read, bs->count_read);
+		swap(sh->badblock_count_write, bs->count_write);
+		swap(sh->badblock_count_slow, bs->count_slow);
+		swap(sh->badblock_count_corrupt, bs->count_corrupt);
+		dust_index_update(sh, true);
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+
+		dust_reap_badblocks(&bs->root);
+	}
+	kvfree(b->bits);
+	kvfree(b);
+}
+
+/*
+ * Build the list of a new target from a checkpoint.
+ */
+static int dust_md_build(struct dust_device *dd,
+			 const struct dust_md_extent *ext, u64 nr)
+{
+	struct dust_build *b;
+	int r;
+
+	r = dust_build(dd->bbl, ext, nr, &b);
+	if (!r)
+		dust_build_publish(dd->bbl, b);
+
+	return r;
+}
+
+static bool dust_md_entry_valid(struct dust_md *md, struct dust_md_entry *e)
+{
+	return le64_to_cpu(e->gen) == md->gen &&
+	       le32_to_cpu(e->csum) == crc32c(0, &e->gen,
+					       sizeof(*e) - sizeof(e->csum));
+}
+
+static int dust_md_replay(struct dust_device *dd, struct dust_md_entry *e)
+{
+	struct dust_bb_op op = {
+		.set = e->set,
+		.clear = e->clear,
+		.set_cnt = e->op_flags & DUST_MD_SET_CNT,
+		.wr_fail_cnt = le32_to_cpu(e->wr_fail_cnt),
+		.set_delay = e->op_flags & DUST_MD_SET_DELAY,
+		.delay_us = le32_to_cpu(e->delay_us),
+	};
+	sector_t first = le64_to_cpu(e->first), last = le64_to_cpu(e->last);
+
+	if (first > last || op.wr_fail_cnt > DUST_MAX_WR_FAIL_CNT)
+		return -EINVAL;
+
+	return dust_bb_update(dd, first, last, &op);
+}
+
+/*
+ * Read the checkpoint of a new target with large sequential reads and
+ * replay the journal on top of it.  A device without a superblock is
+ * formatted.
+ */
+static int dust_md_load(struct dust_device *dd, struct dust_md *md,
+			char **error)
+{
+	struct dust_md_extent *ext = NULL;
+	struct dust_md_entry *e;
+	struct dust_md_sb *sb;
+	sector_t sectors, pos;
+	unsigned long j;
+	void *buf = NULL;
+	u64 nr;
+	int r;
+
+	sb = kmalloc(SECTOR_SIZE, GFP_KERNEL);
+	if (sb == NULL)
+		return -ENOMEM;
+
+	r = dust_md_io(md, REQ_OP_READ, 0, 0, 1, sb);
+	if (r) {
+		*error = "Cannot read metadata superblock";
+		goto out;
+	}
+
+	if (le32_to_cpu(sb->magic) != DUST_MD_MAGIC) {
+		md->gen = 1;
+		r = dust_md_write_sb(md, dd->blksz, md->gen, 0, 0, 0);
+		if (r)
+			*error = "Cannot format metadata device";
+		goto out;
+	}
+
+	nr = le64_to_cpu(sb->nr);
+	if (le32_to_cpu(sb->csum) != crc32c(0, &sb->magic,
+					    sizeof(*sb) - sizeof(sb->csum)) ||
+	    le32_to_cpu(sb->version) != DUST_MD_VERSION ||
+	    nr > md->slot_sectors * SECTOR_SIZE / sizeof(*ext)) {
+		*error = "Invalid metadata superblock";
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (le32_to_cpu(sb->blksz) != dd->blksz) {
+		*error = "Metadata block size mismatch";
+		r = -EINVAL;
+		goto out;
+	}
+
+	md->gen = le64_to_cpu(sb->gen);
+	md->slot = le32_to_cpu(sb->slot) & 1;
+
+	if (nr) {
+		sectors = DIV_ROUND_UP(nr * sizeof(*ext), SECTOR_SIZE);
+		ext = vmalloc(sectors * SECTOR_SIZE);
+		if (ext == NULL) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		r = dust_md_io(md, REQ_OP_READ, 0,
+			       DUST_MD_CKPT_START + md->slot * md->slot_sectors,
+			       sectors, ext);
+		if (r) {
+			*error = "Cannot read metadata checkpoint";
+			goto out;
+		}
+
+		if (crc32c(0, ext, nr * sizeof(*ext)) !=
+		    le32_to_cpu(sb->ckpt_csum)) {
+			*error = "Metadata checkpoint corrupt";
+			r = -EINVAL;
+			goto out;
+		}
+
+		r = dust_md_build(dd, ext, nr);
+		if (r) {
+			*error = "Invalid metadata checkpoint";
+			goto out;
+		}
+	}
+
+	buf = vmalloc(DUST_MD_READ_SECTORS * SECTOR_SIZE);
+	if (buf == NULL) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (pos = 0; pos < DUST_MD_JOURNAL_SECTORS;
+	     pos += DUST_MD_READ_SECTORS) {
+		r = dust_md_io(md, REQ_OP_READ, 0, DUST_MD_JOURNAL_START + pos,
+			       DUST_MD_READ_SECTORS, buf);
+		if (r) {
+			*error = "Cannot read metadata journal";
+			goto out;
+		}
+
+		e = buf;
+		for (j = 0;
+		     j < DUST_MD_READ_SECTORS * DUST_MD_ENTRIES_PER_SECTOR;
+		     j++, e++) {
+			if (!dust_md_entry_valid(md, e))
+				goto replayed;
+
+			r = dust_md_replay(dd, e);
+			if (r) {
+				*error = "Cannot replay metadata journal";
+				goto out;
+			}
+			md->jpos++;
+		}
+	}
+replayed:
+	if (md->jpos % DUST_MD_ENTRIES_PER_SECTOR)
+		memcpy(md->jsect,
+		       buf + j / DUST_MD_ENTRIES_PER_SECTOR * SECTOR_SIZE,
+		       SECTOR_SIZE);
+out:
+	vfree(buf);
+	vfree(ext);
+	kfree(sb);
+
+	return r;
+}
+
+static void dust_md_work(struct work_struct *work)
+{
+	struct dust_md *md = container_of(to_delayed_work(work),
+					  struct dust_md, work);
+
+	mutex_lock(&md->lock);
+	if (READ_ONCE(md->dirty))
+		dust_md_commit(md->dd);
+	mutex_unlock(&md->lock);
+}
+
+/*
+ * Save what the journal does not hold yet.
+ */
+static void dust_md_flush(struct dust_device *dd)
+{
+	struct dust_md *md = dd->md;
+
+	if (md == NULL)
+		return;
+
+	cancel_delayed_work_sync(&md->work);
+	mutex_lock(&md->lock);
+	if (md->dirty)
+		dust_md_commit(dd);
+	mutex_unlock(&md->lock);
+}
+
+static int dust_md_create(struct dm_target *ti, struct dust_device *dd,
+			  const char *path)
+{
+	struct dust_md *md;
+	sector_t size;
+	int r;
+
+	md = kzalloc(sizeof(*md), GFP_KERNEL);
+	if (md == NULL) {
+		ti->error = "Cannot allocate metadata context";
+		return -ENOMEM;
+	}
+	md->dd = dd;
+	mutex_init(&md->lock);
+	INIT_DELAYED_WORK(&md->work, dust_md_work);
+
+	r = dm_get_device(ti, path, dm_table_get_mode(ti->table), &md->dev);
+	if (r) {
+		ti->error = "Metadata device lookup failed";
+		goto bad_dev;
+	}
+
+	size = i_size_read(md->dev->bdev->bd_inode) >> SECTOR_SHIFT;
+	if (size < DUST_MD_CKPT_START + 2) {
+		ti->error = "Metadata device too small";
+		r = -EINVAL;
+		goto bad_size;
+	}
+	md->slot_sectors = (size - DUST_MD_CKPT_START) / 2;
+
+	md->jsect = kzalloc(SECTOR_SIZE, GFP_KERNEL);
+	if (md->jsect == NULL) {
+		ti->error = "Cannot allocate metadata context";
+		r = -ENOMEM;
+		goto bad_size;
+	}
+
+	md->io = dm_io_client_create();
+	if (IS_ERR(md->io)) {
+		ti->error = "Cannot create dm-io client";
+		r = PTR_ERR(md->io);
+		goto bad_io;
+	}
+
+	r = dust_md_load(dd, md, &ti->error);
+	if (r)
+		goto bad_load;
+
+	dd->md = md;
+
+	return 0;
+
+bad_load:
+	dm_io_client_destroy(md->io);
+bad_io:
+	kfree(md->jsect);
+bad_size:
+	dm_put_device(ti, md->dev);
+bad_dev:
+	kfree(md);
+
+	return r;
+}
+
+static void dust_md_destroy(struct dm_target *ti, struct dust_device *dd)
+{
+	struct dust_md *md = dd->md;
+
+	dust_md_flush(dd);
+	dm_io_client_destroy(md->io);
+	kfree(md->jsect);
+	dm_put_device(ti, md->dev);
+	kfree(md);
+	dd->md = NULL;
+}
+
+/*
+ * Free a copy no longer on the list of its bad block list.
+ */
+static void dust_snap_free(struct dust_snap *snap)
+{
+	cancel_work_sync(&snap->work);
+	dust_build_free(snap->bbl, snap->spare);
+	vfree(snap->ext);
+	kfree(snap);
+}
+
+static void dust_snap_work(struct work_struct *work)
+{
+	struct dust_snap *snap = container_of(work, struct dust_snap, work);
+	struct dust_bblist *bbl = snap->bbl;
+	struct dust_build *b;
+
+	if (dust_build(bbl, snap->ext, snap->nr, &b))
+		return;
+
+	mutex_lock(&bbl->snap_lock);
+	if (snap->spare == NULL)
+		swap(snap->spare, b);
+	mutex_unlock(&bbl->snap_lock);
+
+	dust_build_free(bbl, b);
+}
+
+static struct dust_snap *dust_snap_find(struct dust_bblist *bbl,
+					const char *name)
+{
+	struct dust_snap *snap;
+
+	list_for_each_entry(snap, &bbl->snaps, list)
+		if (!strcmp(snap->name, name))
+			return snap;
+
+	return NULL;
+}
+
+/*
+ * Save a copy of the list as name, replacing an older copy of that name.
+ */
+static int dust_snap_take(struct dust_device *dd, const char *name)
+{
+	struct dust_bblist *bbl = dd->bbl;
+	struct dust_snap *snap, *old;
+	int r;
+
+	if (strlen(name) >= DUST_NAME_LEN)
+		return -EINVAL;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap == NULL)
+		return -ENOMEM;
+	snap->bbl = bbl;
+	strlcpy(snap->name, name, sizeof(snap->name));
+	INIT_WORK(&snap->work, dust_snap_work);
+
+	mutex_lock(&bbl->snap_lock);
+	old = dust_snap_find(bbl, name);
+	if (old == NULL && bbl->nr_snaps == DUST_MAX_SNAPS) {
+		mutex_unlock(&bbl->snap_lock);
+		kfree(snap);
+		DMERR("too many snapshots");
+		return -ENOSPC;
+	}
+
+	r = dust_md_snapshot(dd, &snap->ext, &snap->nr);
+	if (r) {
+		mutex_unlock(&bbl->snap_lock);
+		kfree(snap);
+		return r;
+	}
+
+	if (old)
+		list_del(&old->list);
+	else
+		bbl->nr_snaps++;
+	list_add_tail(&snap->list, &bbl->snaps);
+	mutex_unlock(&bbl->snap_lock);
+
+	if (old)
+		dust_snap_free(old);
+
+	return 0;
+}
+
+/*
+ * Replace the list with the copy saved as name.  Its spare trees are
+ * published with a root swap per shard, and the work builds the next
+ * spare ones while the device runs.  Only the first restore of a copy,
+ * or one that comes before the work is done, builds the trees first.
+ * The copy itself is kept to be restored again.  With a metadata device
+ * the new list is checkpointed before another restore can replace it.
+ * Called with the metadata lock held.
+ */
+static int dust_snap_restore(struct dust_device *dd, const char *name)
+{
+	struct dust_bblist *bbl = dd->bbl;
+	struct dust_build *b = NULL;
+	struct dust_snap *snap;
+	int r = 0;
+
+	mutex_lock(&bbl->snap_lock);
+	snap = dust_snap_find(bbl, name);
+	if (snap == NULL) {
+		DMERR("%s: no snapshot '%s'", __func__, name);
+		r = -ENOENT;
+		goto out;
+	}
+
+	swap(b, snap->spare);
+	if (b == NULL) {
+		r = dust_build(bbl, snap->ext, snap->nr, &b);
+		if (r)
+			goto out;
+	}
+	dust_build_publish(bbl, b);
+	queue_work(dust_wq, &snap->work);
+
+	if (!dd->quiet_mode)
+		DMINFO("%s: restored %lu extents from '%s'", __func__,
+		       snap->nr, name);
+
+	if (dd->md)
+		r = dust_md_commit(dd);
+out:
+	mutex_unlock(&bbl->snap_lock);
+
+	return r;
+}
+
+static void dust_shards_destroy(struct dust_bblist *bbl)
+{
+	struct dust_shard *sh;
+	unsigned int i;
+	int node;
+
+	for (i = 0; i < bbl->nr_shards; i++) {
+		sh = &bbl->shards[i];
+		cancel_delayed_work_sync(&sh->index_work);
+		if (sh->array) {
+			for_each_node(node)
+				kvfree(rcu_access_pointer(sh->array[node]));
+			kfree(sh->array);
+		}
+		dust_reap_badblocks(&sh->badblocklist);
+	}
+	kfree(bbl->shards);
+}
+
+/*
+ * Split the block space of a device of blocks blocks into nr shards.
+ * Shards start on a word of the filter bitmap and grow until nr of them
+ * cover the device; blocks past its end go to the last one.
+ */
+static int dust_shards_init(struct dust_bblist *bbl, unsigned int nr,
+			    sector_t blocks)
+{
+	struct dust_shard *sh;
+	unsigned int i;
+
+	bbl->shard_shift = bbl->filter.shift + ilog2(BITS_PER_LONG);
+	while ((blocks >> bbl->shard_shift) >= nr)
+		bbl->shard_shift++;
+
+	bbl->shards = kcalloc(nr, sizeof(*bbl->shards), GFP_KERNEL);
+	if (bbl->shards == NULL)
+		return -ENOMEM;
+	bbl->nr_shards = nr;
+
+	for (i = 0; i < nr; i++) {
+		sh = &bbl->shards[i];
+		sh->bbl = bbl;
+		sh->badblocklist = RB_ROOT;
+		INIT_DELAYED_WORK(&sh->index_work, dust_index_work);
+		sh->badblock_count_read = 0;
+		sh->badblock_count_write = 0;
+		sh->badblock_count_slow = 0;
+		sh->badblock_count_corrupt = 0;
+		spin_lock_init(&sh->dust_lock);
+		seqcount_init(&sh->dust_seq);
+	}
+
+	for (i = 0; i < nr; i++) {
+		sh = &bbl->shards[i];
+		sh->array = kcalloc(nr_node_ids, sizeof(*sh->array),
+				    GFP_KERNEL);
+		if (sh->array == NULL) {
+			dust_shards_destroy(bbl);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Find the bad block list called name, or create one: a new list when
+ * name is NULL.  A shared list must be over the same device with the
+ * same parameters.
+ */
+static int dust_bblist_get(const char *name, struct block_device *bdev,
+			   unsigned int blksz, unsigned int nr_shards,
+			   enum dust_index index, sector_t blocks,
+			   struct dust_bblist **bblp)
+{
+	struct dust_bblist *bbl;
+	int r = 0;
+
+	mutex_lock(&dust_bblist_lock);
+	if (name) {
+		list_for_each_entry(bbl, &dust_bblists, list) {
+			if (strcmp(bbl->name, name))
+				continue;
+			if (bbl->bdev != bdev || bbl->blksz != blksz ||
+			    bbl->nr_shards != nr_shards || bbl->index != index)
+				r = -EINVAL;
+			else {
+				bbl->ref++;
+				*bblp = bbl;
+			}
+			goto out;
+		}
+	}
+
+	bbl = kzalloc(sizeof(*bbl), GFP_KERNEL);
+	if (bbl == NULL) {
+		r = -ENOMEM;
+		goto out;
+	}
+	INIT_LIST_HEAD(&bbl->list);
+	spin_lock_init(&bbl->pub_lock);
+	INIT_LIST_HEAD(&bbl->pubs);
+	bbl->nr_pubs = 0;
+	mutex_init(&bbl->snap_lock);
+	INIT_LIST_HEAD(&bbl->snaps);
+	bbl->ref = 1;
+	bbl->bdev = bdev;
+	bbl->blksz = blksz;
+	bbl->index = index;
+
+	if (dust_filter_init(&bbl->filter, blocks)) {
+		kfree(bbl);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (dust_shards_init(bbl, nr_shards, blocks)) {
+		kvfree(bbl->filter.bits);
+		kfree(bbl);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (name) {
+		strlcpy(bbl->name, name, sizeof(bbl->name));
+		list_add(&bbl->list, &dust_bblists);
+	}
+	*bblp = bbl;
+out:
+	mutex_unlock(&dust_bblist_lock);
+
+	return r;
+}
+
+static void dust_bblist_put(struct dust_bblist *bbl)
+{
+	struct dust_snap *snap, *next;
+
+	mutex_lock(&dust_bblist_lock);
+	if (--bbl->ref) {
+		mutex_unlock(&dust_bblist_lock);
+		return;
+	}
+	list_del(&bbl->list);
+	mutex_unlock(&dust_bblist_lock);
+
+	list_for_each_entry_safe(snap, next, &bbl->snaps, list) {
+		list_del(&snap->list);
+		dust_snap_free(snap);
+	}
+	dust_shards_destroy(bbl);
+	kvfree(bbl->filter.bits);
+	kfree(bbl);
+}
+
+/*
+ * One benchmark thread: ops reads or writes of one pseudo-random block
+ * each, put through the map path of a private copy of the target on one
+ * CPU, with a bio of its own.  A run stops early after DUST_BENCH_MAX_NS
+ * so that the message does not hold up dmsetup for long.  contended
+ * counts the bios that found the lock of their shard held as they were
+ * mapped.
+ */
+#define DUST_BENCH_BLOCKS 1024
+#define DUST_BENCH_MAX_OPS 1000000000ULL
+#define DUST_BENCH_MAX_NS (5ULL * NSEC_PER_SEC)
+
+struct dust_bench {
+	struct work_struct work;
+	struct dust_device *dd;
+	struct bio *bio;
+	bool write;
+	unsigned long long ops;
+	u64 ns;
+	u64 failed;
+	u64 contended;
+	sector_t blocks[DUST_BENCH_BLOCKS];
+};
+
+/*
+ * The bios cover one block each, so neither dust_shard_trim() nor the
+ * map functions ever cut them, which only DM core bios could be.
+ */
+static void dust_bench_work(struct work_struct *work)
+{
+	struct dust_bench *b = container_of(work, struct dust_bench, work);
+	struct dust_device *dd = b->dd;
+	struct bio *bio = b->bio;
+	unsigned long long i;
+	sector_t blk;
+	u64 start;
+	int r;
+
+	start = ktime_get_ns();
+	for (i = 0; i < b->ops; i++) {
+		blk = b->blocks[i % DUST_BENCH_BLOCKS];
+		bio->bi_iter.bi_sector = blk << dd->sect_per_block_shift;
+		bio->bi_iter.bi_size = dd->blksz;
+		if (spin_is_locked(&dust_shard(dd, blk)->dust_lock))
+			b->contended++;
+		dust_shard_trim(dd, bio);
+		if (b->write)
+			r = dust_map_write(dd, bio,
+					   READ_ONCE(dd->fail_read_on_bb),
+					   READ_ONCE(dd->fail_write_on_bb));
+		else
+			r = dust_map_read(dd, bio,
+					  READ_ONCE(dd->fail_read_on_bb));
+		if (r == DM_MAPIO_KILL)
+			b->failed++;
+		if (!(i % DUST_BULK_BATCH)) {
+			cond_resched();
+			if (ktime_get_ns() - start > DUST_BENCH_MAX_NS) {
+				i++;
+				break;
+			}
+		}
+	}
+	b->ops = i;
+	b->ns = ktime_get_ns() - start;
+}
+
+/*
+ * Set up a private copy of dd to benchmark: a new bad block list with the
+ * same parameters, built from the extents of the list of dd, the same
+ * failure modes and rates, and statistics, events and random state of
+ * its own.  It is quiet and has no metadata device, so the bios put
+ * through it neither change the list of dd nor count on dd.
+ */
+static struct dust_device *dust_bench_device(struct dust_device *dd)
+{
+	struct dust_bblist *bbl = dd->bbl;
+	struct dust_md_extent *ext;
+	struct dust_device *bd;
+	struct dust_build *b;
+	unsigned long nr;
+	sector_t blocks;
+	unsigned int i;
+	int r;
+
+	bd = kzalloc(sizeof(*bd), GFP_KERNEL);
+	if (bd == NULL)
+		return NULL;
+	bd->dev = dd->dev;
+	bd->blksz = dd->blksz;
+	bd->sect_per_block_shift = dd->sect_per_block_shift;
+	bd->sect_per_block = dd->sect_per_block;
+	bd->start = dd->start;
+	bd->discard = dd->discard;
+	bd->fail_read_on_bb = READ_ONCE(dd->fail_read_on_bb);
+	bd->fail_write_on_bb = READ_ONCE(dd->fail_write_on_bb);
+	bd->fail_rate[READ] = dd->fail_rate[READ];
+	bd->fail_rate[WRITE] = dd->fail_rate[WRITE];
+	bd->quiet_mode = true;
+
+	bd->stats = alloc_percpu(struct dust_stats);
+	bd->events = alloc_percpu(struct dust_event_ring);
+	bd->rnd_state = alloc_percpu(struct rnd_state);
+	if (bd->stats == NULL || bd->events == NULL || bd->rnd_state == NULL)
+		goto bad;
+	dust_rate_seed(bd, READ_ONCE(dd->rand_seed));
+
+	blocks = (i_size_read(dd->dev->bdev->bd_inode) >> SECTOR_SHIFT) >>
+		 dd->sect_per_block_shift;
+	if (dust_bblist_get(NULL, bbl->bdev, bbl->blksz, bbl->nr_shards,
+			    bbl->index, blocks, &bd->bbl))
+		goto bad;
+
+	if (dust_md_snapshot(dd, &ext, &nr))
+		goto bad;
+	r = dust_build(bd->bbl, ext, nr, &b);
+	vfree(ext);
+	if (r)
+		goto bad;
+	dust_build_publish(bd->bbl, b);
+
+	/*
+	 * Have the array index built now rather than measure the tree.
+	 */
+	if (bd->bbl->index == DUST_INDEX_ARRAY)
+		for (i = 0; i < bd->bbl->nr_shards; i++)
+			flush_delayed_work(&bd->bbl->shards[i].index_work);
+
+	return bd;
+bad:
+	if (bd->bbl)
+		dust_bblist_put(bd->bbl);
+	free_percpu(bd->rnd_state);
+	free_percpu(bd->events);
+	free_percpu(bd->stats);
+	kfree(bd);
+
+	return NULL;
+}
+
+static void dust_bench_device_free(struct dust_device *bd)
+{
+	dust_bblist_put(bd->bbl);
+	free_percpu(bd->rnd_state);
+	free_percpu(bd->events);
+	free_percpu(bd->stats);
+	kfree(bd);
+}
+
+/*
+ * benchmark <read|write> <ops> [<threads>]
+ *
+ * Put ops single block bios through the map path of a private copy of
+ * the target on each of threads online CPUs, with the failure modes as
+ * they are set, and report the average cost per bio, the aggregate
+ * rate, how many bios failed and how many found the lock of their shard
+ * held.  Writes heal and consume write failures of the copy only, so
+ * the list and the statistics of the target are left as they are.  Load
+ * the list to measure with first.
+ */
+static int dust_message_benchmark(struct dust_device *dd, unsigned int argc,
+				  char **argv, sector_t size, char *result,
+				  unsigned int maxlen)
+{
+	unsigned long long ops, total_ops = 0;
+	unsigned int threads = 1, i, n = 0, sz = 0;
+	u64 ns = 0, rate = 0, failed = 0, contended = 0, rem;
+	struct dust_bench *benches;
+	struct dust_device *bd;
+	struct rnd_state state;
+	bool write;
+	char dummy;
+	int cpu, j, r = 1;
+
+	if (argc != 3 && argc != 4) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	if (!strcasecmp(argv[1], "read"))
+		write = false;
+	else if (!strcasecmp(argv[1], "write"))
+		write = true;
+	else {
+		DMERR("unrecognized message '%s' received", argv[0]);
+		return -EINVAL;
+	}
+
+	if (sscanf(argv[2], "%llu%c", &ops, &dummy) != 1 ||
+	    (argc == 4 && sscanf(argv[3], "%u%c", &threads, &dummy) != 1))
+		return -EINVAL;
+
+	if (!ops || ops > DUST_BENCH_MAX_OPS || !threads ||
+	    threads > num_online_cpus()) {
+		DMERR("selected benchmark parameters out of range");
+		return -EINVAL;
+	}
+
+	benches = kvcalloc(threads, sizeof(*benches), GFP_KERNEL);
+	if (benches == NULL)
+		return -ENOMEM;
+
+	bd = dust_bench_device(dd);
+	if (bd == NULL) {
+		kvfree(benches);
+		return -ENOMEM;
+	}
+
+	size >>= dd->sect_per_block_shift;
+	prandom_seed_state(&state, READ_ONCE(dd->rand_seed));
+	for (i = 0; i < threads; i++) {
+		benches[i].bio = bio_alloc(GFP_KERNEL, 0);
+		if (benches[i].bio == NULL) {
+			r = -ENOMEM;
+			goto out;
+		}
+		bio_set_dev(benches[i].bio, dd->dev->bdev);
+		benches[i].bio->bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+		benches[i].dd = bd;
+		benches[i].write = write;
+		benches[i].ops = ops;
+		INIT_WORK(&benches[i].work, dust_bench_work);
+		for (j = 0; j < DUST_BENCH_BLOCKS; j++) {
+			rem = (u64)prandom_u32_state(&state) << 32 |
+			      prandom_u32_state(&state);
+			div64_u64_rem(rem, size + 1, &rem);
+			benches[i].blocks[j] = rem;
+		}
+	}
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		if (n == threads)
+			break;
+		queue_work_on(cpu, system_highpri_wq, &benches[n++].work);
+	}
+	for (i = 0; i < n; i++)
+		flush_work(&benches[i].work);
+	cpus_read_unlock();
+
+	for (i = 0; i < n; i++) {
+		total_ops += benches[i].ops;
+		ns += benches[i].ns;
+		rate += div64_u64(benches[i].ops * NSEC_PER_SEC,
+				  max_t(u64, benches[i].ns, 1));
+		failed += benches[i].failed;
+		contended += benches[i].contended;
+	}
+
+	DMEMIT("threads=%u ops=%llu ns_per_op=%llu ops_per_sec=%llu "
+	       "failed=%llu contended=%llu", n, total_ops,
+	       div64_u64(ns, max_t(u64, total_ops, 1)), rate, failed,
+	       contended);
+out:
+	for (i = 0; i < threads; i++)
+		if (benches[i].bio)
+			bio_put(benches[i].bio);
+	dust_bench_device_free(bd);
+	kvfree(benches);
+
+	return r;
+}
+
+/*
+ * Mark sectors [s, s + len) of the disk bad.  Returns false once the
+ * table is full.
+ */
+static bool dust_pub_set(struct badblocks *bb, sector_t s, sector_t len)
+{
+	int n;
+
+	for (; len; s += n, len -= n) {
+		n = min_t(sector_t, len, 1 << 30);
+		if (badblocks_set(bb, s, n, 1))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Copy the read bad extents under the target into the bad block table
+ * of its disk, in sectors of the disk.  The table is emptied first, so
+ * for a moment it may show fewer ranges.
+ */
+static void dust_pub_work(struct work_struct *work)
+{
+	struct dust_device *dd = container_of(to_delayed_work(work),
+					      struct dust_device, bb_work);
+	struct dm_target *ti = dd->ti;
+	int shift = dd->sect_per_block_shift;
+	sector_t first = dd->start >> shift;
+	sector_t last = (dd->start + ti->len - 1) >> shift;
+	sector_t blk, lb, start, end, n;
+	struct badblock *bblk;
+	struct dust_shard *sh;
+	unsigned long flags;
+	bool room = true;
+
+	for (start = ti->begin; start < ti->begin + ti->len; start += n) {
+		n = min_t(sector_t, ti->begin + ti->len - start, 1 << 30);
+		badblocks_clear(dd->bb, start, n);
+	}
+
+	for (blk = first; blk <= last && room; blk = dust_shard_last(sh) + 1) {
+		sh = dust_shard(dd, blk);
+		spin_lock_irqsave(&sh->dust_lock, flags);
+		bblk = dust_rb_lower_bound(&sh->badblocklist, blk);
+		for (; bblk && bblk->bb <= last && room;
+		     bblk = dust_bb_next(bblk)) {
+			if (!(bblk->flags & DUST_BB_READ))
+				continue;
+			start = max(bblk->bb << shift, dd->start);
+			lb = min(dust_bb_last(bblk), last);
+			end = min((lb + 1) << shift, dd->start + ti->len);
+			room = dust_pub_set(dd->bb,
+					    ti->begin + start - dd->start,
+					    end - start);
+		}
+		spin_unlock_irqrestore(&sh->dust_lock, flags);
+		if (dust_shard_last(sh) >= last)
+			break;
+		cond_resched();
+	}
+
+	if (!room)
+		DMWARN("%s: bad block table full, not every bad range published",
+		       dd->dev->name);
+}
+
+/*
+ * Publish the list to the disk of the target as it is resumed, unless
+ * another target already publishes there.
+ */
+static void dust_pub_start(struct dust_device *dd)
+{
+	struct gendisk *disk = dm_disk(dm_table_get_md(dd->ti->table));
+	struct dust_bblist *bbl = dd->bbl;
+	unsigned long flags;
+
+	if (dd->bb == NULL || dd->bb_published)
+		return;
+
+	if (disk->bb) {
+		DMWARN("%s: bad blocks of %s published by another target",
+		       dd->dev->name, disk->disk_name);
+		return;
+	}
+	disk->bb = dd->bb;
+
+	spin_lock_irqsave(&bbl->pub_lock, flags);
+	list_add(&dd->bb_list, &bbl->pubs);
+	WRITE_ONCE(bbl->nr_pubs, bbl->nr_pubs + 1);
+	spin_unlock_irqrestore(&bbl->pub_lock, flags);
+	dd->bb_published = true;
+	queue_delayed_work(dust_wq, &dd->bb_work, 0);
+}
+
+static void dust_pub_stop(struct dust_device *dd)
+{
+	struct gendisk *disk = dm_disk(dm_table_get_md(dd->ti->table));
+	struct dust_bblist *bbl = dd->bbl;
+	unsigned long flags;
+
+	if (!dd->bb_published)
+		return;
+
+	spin_lock_irqsave(&bbl->pub_lock, flags);
+	list_del(&dd->bb_list);
+	WRITE_ONCE(bbl->nr_pubs, bbl->nr_pubs - 1);
+	spin_unlock_irqrestore(&bbl->pub_lock, flags);
+	cancel_delayed_work_sync(&dd->bb_work);
+	if (disk->bb == dd->bb)
+		disk->bb = NULL;
+	dd->bb_published = false;
+}
+
+/*
+ * Optional constructor arguments.
+ */
+struct dust_features {
+	enum dust_index index;
+	const char *metadata;
+	unsigned int shards;
+	blk_status_t error_status;
+	enum dust_discard discard;
+	const char *share;
+	bool badblocks;
+};
+
+static int dust_parse_features(struct dm_arg_set *as,
+			       struct dust_features *features, char **error)
+{
+	static const struct dm_arg _args[] = {
+		{0, 13, "Invalid number of feature args"},
+	};
+	unsigned int argc;
+	const char *arg;
+	int r;
+
+	features->index = DUST_INDEX_RBTREE;
+	features->metadata = NULL;
+	features->shards = 1;
+	features->error_status = BLK_STS_IOERR;
+	features->discard = DUST_DISCARD_HEAL;
+	features->share = NULL;
+	features->badblocks = false;
+
+	if (!as->argc)
+		return 0;
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return r;
+
+	while (argc) {
+		arg = dm_shift_arg(as);
+		argc--;
+
+		if (!strcasecmp(arg, "index") && argc) {
+			arg = dm_shift_arg(as);
+			argc--;
+			if (!strcasecmp(arg, "rbtree"))
+				features->index = DUST_INDEX_RBTREE;
+			else if (!strcasecmp(arg, "array"))
+				features->index = DUST_INDEX_ARRAY;
+			else {
+				*error = "Invalid index type";
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(arg, "metadata") && argc) {
+			features->metadata = dm_shift_arg(as);
+			argc--;
+			continue;
+		}
+
+		if (!strcasecmp(arg, "shards") && argc) {
+			arg = dm_shift_arg(as);
+			argc--;
+			if (kstrtouint(arg, 10, &features->shards) ||
+			    !features->shards ||
+			    features->shards > DUST_MAX_SHARDS) {
+				*error = "Invalid number of shards";
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(arg, "error") && argc) {
+			arg = dm_shift_arg(as);
+			argc--;
+			if (dust_parse_error_status(arg,
+						    &features->error_status)) {
+				*error = "Invalid error status";
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(arg, "discard") && argc) {
+			arg = dm_shift_arg(as);
+			argc--;
+			if (!strcasecmp(arg, "heal"))
+				features->discard = DUST_DISCARD_HEAL;
+			else if (!strcasecmp(arg, "fail"))
+				features->discard = DUST_DISCARD_FAIL;
+			else if (!strcasecmp(arg, "ignore"))
+				features->discard = DUST_DISCARD_IGNORE;
+			else {
+				*error = "Invalid discard policy";
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(arg, "share") && argc) {
+			features->share = dm_shift_arg(as);
+			argc--;
+			if (!*features->share ||
+			    strlen(features->share) >= DUST_NAME_LEN) {
+				*error = "Invalid bad block list name";
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(arg, "badblocks")) {
+			features->badblocks = true;
+			continue;
+		}
+
+		*error = "Unrecognised feature argument";
+		return -EINVAL;
+	}
+
+	if (as->argc) {
+		*error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	if (features->share && features->metadata) {
+		*error = "Cannot share a bad block list on a metadata device";
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Target parameters:
+ *
+ * <device_path> <offset> <blksz> [<#feature_args> <feature_arg>*]
+ *
+ * device_path: path to the block device
+ * offset: offset to data area from start of device_path
+ * blksz: block size (minimum 512, maximum 1073741824, must be a power of 2)
+ *
+ * Optional feature arguments:
+ *
+ * index <rbtree|array>: how the map path looks bad blocks up
+ * metadata <dev_path>: device that keeps the bad block list
+ * shards <n>: number of regions with a bad block list and lock each
+ * error <ioerr|medium|timeout|target>: status failed bios complete with
+ * discard <heal|fail|ignore>: what discards do to the bad blocks they cover
+ * share <name>: use the bad block list of that name, shared with other
+ *		 targets over the same device
+ * badblocks: publish the read bad ranges to the bad block table of the disk
+ */
+static int dust_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct dust_features features;
+	struct dm_arg_set as;
+	struct dust_device *dd;
+	struct dust_delay_queue *q;
+	unsigned long long tmp;
+	sector_t blocks;
+	char dummy;
+	int cpu, r;
+	unsigned int blksz;
+	unsigned int sect_per_block;
+	sector_t DUST_MAX_BLKSZ_SECTORS = 2097152;
+	sector_t max_block_sectors = min(ti->len, DUST_MAX_BLKSZ_SECTORS);
+
+	if (argc < 3) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	as.argc = argc - 3;
+	as.argv = argv + 3;
+	r = dust_parse_features(&as, &features, &ti->error);
+	if (r)
+		return r;
+
+	if (kstrtouint(argv[2], 10, &blksz) || !blksz) {
+		ti->error = "Invalid block size parameter";
+		return -EINVAL;
+	}
+
+	if (blksz < 512) {
+		ti->error = "Block size must be at least 512";
+		return -EINVAL;
+	}
+
+	if (!is_power_of_2(blksz)) {
+		ti->error = "Block size must be a power of 2";
+		return -EINVAL;
+	}
+
+	if (to_sector(blksz) > max_block_sectors) {
+		ti->error = "Block size is too large";
+		return -EINVAL;
+	}
+
+	sect_per_block = (blksz >> SECTOR_SHIFT);
+
+	if (sscanf(argv[1], "%llu%c", &tmp, &dummy) != 1 || tmp != (sector_t)tmp) {
+		ti->error = "Invalid device offset sector";
+		return -EINVAL;
+	}
+
+	dd = kzalloc(sizeof(struct dust_device), GFP_KERNEL);
+	if (dd == NULL) {
+		ti->error = "Cannot allocate context";
+		return -ENOMEM;
+	}
+	dd->ti = ti;
+
+	dd->stats = alloc_percpu(struct dust_stats);
+	if (dd->stats == NULL) {
+		ti->error = "Cannot allocate statistics";
+		r = -ENOMEM;
+		goto bad_stats;
+	}
+
+	dd->lat = alloc_percpu(struct dust_lat);
+	if (dd->lat == NULL) {
+		ti->error = "Cannot allocate latency histograms";
+		r = -ENOMEM;
+		goto bad_lat;
+	}
+
+	dd->delay_queues = alloc_percpu(struct dust_delay_queue);
+	if (dd->delay_queues == NULL) {
+		ti->error = "Cannot allocate delay queues";
+		r = -ENOMEM;
+		goto bad_queues;
+	}
+
+	dd->rnd_state = alloc_percpu(struct rnd_state);
+	if (dd->rnd_state == NULL) {
+		ti->error = "Cannot allocate random state";
+		r = -ENOMEM;
+		goto bad_rnd;
+	}
+
+	dd->events = alloc_percpu(struct dust_event_ring);
+	if (dd->events == NULL) {
+		ti->error = "Cannot allocate event rings";
+		r = -ENOMEM;
+		goto bad_events;
+	}
+
+	r = dust_trig_init(&dd->trig);
+	if (r) {
+		ti->error = "Cannot allocate trigger counters";
+		goto bad_trig;
+	}
+
+	if (dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &dd->dev)) {
+		ti->error = "Device lookup failed";
+		r = -EINVAL;
+		goto bad_dev;
+	}
+
+	blocks = (i_size_read(dd->dev->bdev->bd_inode) >> SECTOR_SHIFT) >>
+		 __ffs(sect_per_block);
+	r = dust_bblist_get(features.share, dd->dev->bdev, blksz,
+			    features.shards, features.index, blocks, &dd->bbl);
+	if (r) {
+		ti->error = r == -EINVAL ?
+			    "Shared bad block list has other parameters" :
+			    "Cannot allocate bad block list";
+		goto bad_bbl;
+	}
+
+	INIT_DELAYED_WORK(&dd->bb_work, dust_pub_work);
+	INIT_LIST_HEAD(&dd->bb_list);
+	if (features.badblocks) {
+		dd->bb = kzalloc(sizeof(*dd->bb), GFP_KERNEL);
+		if (dd->bb == NULL || badblocks_init(dd->bb, 1)) {
+			kfree(dd->bb);
+			ti->error = "Cannot allocate bad block table";
+			r = -ENOMEM;
+			goto bad_pub;
+		}
+	}
+
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(dd->delay_queues, cpu);
+		q->dd = dd;
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->bios);
+		hrtimer_init(&q->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		q->timer.function = dust_delay_timer;
+		INIT_WORK(&q->work, dust_delay_work);
+		seqcount_init(&per_cpu_ptr(dd->events, cpu)->seq);
+	}
+	mutex_init(&dd->event_lock);
+	mutex_init(&dd->sched.lock);
+	hrtimer_init(&dd->sched.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dd->sched.timer.function = dust_sched_timer;
+	INIT_WORK(&dd->sched.work, dust_sched_work);
+	ratelimit_state_init(&dd->event_rs, DEFAULT_RATELIMIT_INTERVAL,
+			     DEFAULT_RATELIMIT_BURST);
+
+	dd->sect_per_block = sect_per_block;
+	dd->blksz = blksz;
+	dd->start = tmp;
+
+	dd->sect_per_block_shift = __ffs(sect_per_block);
+
+	/*
+	 * Whether to fail a read on a "bad" block.
+	 * Defaults to false; enabled later by message.
+	 */
+	dd->fail_read_on_bb = false;
+
+	/*
+	 * Fail a write on a "bad" block.
+	 * Defaults to false; enabled later by message.
+	 */
+	dd->fail_write_on_bb = false;
+
+	dd->error_status = features.error_status;
+	dd->discard = features.discard;
+
+	/*
+	 * No random failures until a rate is set.
+	 */
+	dust_rate_seed(dd, 0);
+
+	dd->quiet_mode = false;
+
+	/*
+	 * Corruption flips the lowest bit of a corrupt block, once enabled.
+	 */
+	dd->corrupt_on_bb = false;
+	dd->corrupt_offset = 0;
+	dd->corrupt_xor = 0x1;
+
+	if (features.metadata) {
+		r = dust_md_create(ti, dd, features.metadata);
+		if (r)
+			goto bad_md;
+	}
+
+	ti->num_discard_bios = 1;
+	ti->num_write_zeroes_bios = 1;
+	ti->num_flush_bios = 1;
+	ti->per_io_data_size = sizeof(struct dust_bio);
+	ti->private = dd;
+
+	return 0;
+
+bad_md:
+	if (dd->bb)
+		badblocks_exit(dd->bb);
+	kfree(dd->bb);
+bad_pub:
+	dust_bblist_put(dd->bbl);
+bad_bbl:
+	dm_put_device(ti, dd->dev);
+bad_dev:
+	dust_trig_destroy(&dd->trig);
+bad_trig:
+	free_percpu(dd->events);
+bad_events:
+	free_percpu(dd->rnd_state);
+bad_rnd:
+	free_percpu(dd->delay_queues);
+bad_queues:
+	free_percpu(dd->lat);
+bad_lat:
+	free_percpu(dd->stats);
+bad_stats:
+	kfree(dd);
+
+	return r;
+}
+
+static void dust_dtr(struct dm_target *ti)
+{
+	struct dust_device *dd = ti->private;
+
+	dust_set_fail_mode(dd, &dd->fail_read_on_bb, false);
+	dust_set_fail_mode(dd, &dd->fail_write_on_bb, false);
+	dust_set_fail_mode(dd, &dd->delay_on_bb, false);
+	dust_set_fail_mode(dd, &dd->corrupt_on_bb, false);
+	dust_sched_stop(&dd->sched);
+	cancel_work_sync(&dd->sched.work);
+	kvfree(dd->sched.ents);
+	dust_trig_destroy(&dd->trig);
+	WRITE_ONCE(dd->delay_suspended, true);
+	dust_delay_flush(dd);
+	if (dd->md)
+		dust_md_destroy(ti, dd);
+	dust_pub_stop(dd);
+	if (dd->bb)
+		badblocks_exit(dd->bb);
+	kfree(dd->bb);
+	dust_bblist_put(dd->bbl);
+	dm_put_device(ti, dd->dev);
+	free_percpu(dd->events);
+	free_percpu(dd->rnd_state);
+	free_percpu(dd->delay_queues);
+	free_percpu(dd->lat);
+	free_percpu(dd->stats);
+	kfree(dd);
+}
+
+/*
+ * Suspend waits for all bios in flight, so the delayed ones are sent
+ * down at once, and no bio is delayed until the target is resumed.
+ */
+static void dust_presuspend(struct dm_target *ti)
+{
+	struct dust_device *dd = ti->private;
+
+	WRITE_ONCE(dd->delay_suspended, true);
+	dust_delay_flush(dd);
+}
+
+/*
+ * Nothing changes the list once all I/O is done; checkpoint what the
+ * map path changed.
+ */
+static void dust_postsuspend(struct dm_target *ti)
+{
+	dust_pub_stop(ti->private);
+	dust_md_flush(ti->private);
+}
+
+static void dust_resume(struct dm_target *ti)
+{
+	struct dust_device *dd = ti->private;
+
+	WRITE_ONCE(dd->delay_suspended, false);
+	dust_pub_start(dd);
+}
+
+/*
+ * addbadrange <read|write> <first> <last> [<wr_fail_cnt>]
+ * addbadrange slow <first> <last> <delay_us>
+ * addbadrange corrupt <first> <last>
+ * removebadrange <read|write|slow|corrupt> <first> <last>
+ */
+static int dust_parse_range_cmd(struct dust_device *dd, unsigned int argc,
+				char **argv, sector_t size,
+				struct dust_range_cmd *cmd)
+{
+	bool add = !strcasecmp(argv[0], "addbadrange");
+	unsigned long long first, last;
+	unsigned int tmp_ui = 0;
+	unsigned char flag;
+	char dummy;
+
+	if (argc < 2) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	if (!strcasecmp(argv[1], "read"))
+		flag = DUST_BB_READ;
+	else if (!strcasecmp(argv[1], "write"))
+		flag = DUST_BB_WRITE;
+	else if (!strcasecmp(argv[1], "slow"))
+		flag = DUST_BB_SLOW;
+	else if (!strcasecmp(argv[1], "corrupt"))
+		flag = DUST_BB_CORRUPT;
+	else {
+		DMERR("unrecognized message '%s' received", argv[0]);
+		return -EINVAL;
+	}
+
+	if ((add && flag == DUST_BB_SLOW && argc != 5) ||
+	    (flag == DUST_BB_CORRUPT && argc != 4) ||
+	    (argc != 4 && !(add && argc == 5))) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	if (sscanf(argv[2], "%llu%c", &first, &dummy) != 1 ||
+	    sscanf(argv[3], "%llu%c", &last, &dummy) != 1)
+		return -EINVAL;
+
+	if (argc == 5 && sscanf(argv[4], "%u%c", &tmp_ui, &dummy) != 1)
+		return -EINVAL;
+
+	if (flag == DUST_BB_SLOW) {
+		if (add && (!tmp_ui || tmp_ui > DUST_DELAY_MAX_US)) {
+			DMERR("selected delay out of range");
+			return -EINVAL;
+		}
+	} else if (tmp_ui > DUST_MAX_WR_FAIL_CNT) {
+		DMERR("selected write fail count out of range");
+		return -EINVAL;
+	}
+
+	sector_div(size, dd->sect_per_block);
+	if (first > last || last > size) {
+		DMERR("selected block range out of range");
+		return -EINVAL;
+	}
+
+	cmd->add = add;
+	cmd->flag = flag;
+	cmd->first = first;
+	cmd->last = last;
+	cmd->arg = tmp_ui;
+
+	return 0;
+}
+
+static int dust_message_range(struct dust_device *dd, unsigned int argc,
+			      char **argv, sector_t size)
+{
+	struct dust_range_cmd cmd;
+	int r;
+
+	r = dust_parse_range_cmd(dd, argc, argv, size, &cmd);
+	if (r)
+		return r;
+
+	return dust_range_cmd_apply(dd, &cmd);
+}
+
+/*
+ * trigger <reads|writes|bytes> <n> <addbadrange|removebadrange> <args>
+ * trigger <clear|status>
+ *
+ * Make a range change, in the syntax of its message, once the device
+ * has seen n more reads, writes or bytes.  status reports the counts so
+ * far and the number of triggers still pending.
+ */
+static int dust_message_trigger(struct dust_device *dd, unsigned int argc,
+				char **argv, sector_t size, char *result,
+				unsigned int maxlen)
+{
+	struct dust_triggers *t = &dd->trig;
+	struct dust_trigger *trig;
+	unsigned long long n;
+	unsigned int sz = 0;
+	char dummy;
+	int kind, r;
+
+	if (argc == 2 && !strcasecmp(argv[1], "clear")) {
+		dust_trig_clear(t);
+		return 0;
+	}
+
+	if (argc == 2 && !strcasecmp(argv[1], "status")) {
+		for (kind = 0; kind < DUST_TRIG_NR; kind++)
+			DMEMIT("%s=%lld ", dust_trig_names[kind],
+			       percpu_counter_sum(&t->count[kind]));
+		DMEMIT("pending=%u", READ_ONCE(t->nr));
+		return 1;
+	}
+
+	if (argc < 4) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	for (kind = 0; kind < DUST_TRIG_NR; kind++)
+		if (!strcasecmp(argv[1], dust_trig_names[kind]))
+			break;
+	if (kind == DUST_TRIG_NR ||
+	    sscanf(argv[2], "%llu%c", &n, &dummy) != 1 || n > S64_MAX / 2)
+		return -EINVAL;
+
+	if (strcasecmp(argv[3], "addbadrange") &&
+	    strcasecmp(argv[3], "removebadrange")) {
+		DMERR("unrecognized message '%s' received", argv[3]);
+		return -EINVAL;
+	}
+
+	trig = kmalloc(sizeof(*trig), GFP_KERNEL);
+	if (trig == NULL)
+		return -ENOMEM;
+
+	r = dust_parse_range_cmd(dd, argc - 3, argv + 3, size, &trig->cmd);
+	if (r) {
+		kfree(trig);
+		return r;
+	}
+	trig->kind = kind;
+
+	mutex_lock(&t->lock);
+	if (t->nr == DUST_MAX_TRIGGERS) {
+		mutex_unlock(&t->lock);
+		kfree(trig);
+		DMERR("too many triggers");
+		return -ENOSPC;
+	}
+	trig->at = percpu_counter_sum(&t->count[kind]) + n;
+	list_add_tail(&trig->list, &t->list);
+	t->nr++;
+	dust_trig_update_next(t);
+	mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+/*
+ * schedule <ms> <addbadrange|removebadrange> <args>
+ * schedule <start|stop|clear|status>
+ *
+ * Load a range change, in the syntax of its message, to be made ms
+ * milliseconds after the schedule is started.  Changes at the same
+ * offset are made in the order they were loaded.  start runs the
+ * schedule from its beginning, stop halts it, and clear drops it; it
+ * can only be loaded while stopped.  status reports whether it runs and
+ * how many of its changes were made.
+ */
+static int dust_message_schedule(struct dust_device *dd, unsigned int argc,
+				 char **argv, sector_t size, char *result,
+				 unsigned int maxlen)
+{
+	struct dust_sched *s = &dd->sched;
+	struct dust_sched_ent *ents;
+	struct dust_range_cmd cmd;
+	unsigned long long ms;
+	unsigned int i, sz = 0;
+	char dummy;
+	int r = 0;
+
+	if (argc == 2 && !strcasecmp(argv[1], "status")) {
+		mutex_lock(&s->lock);
+		DMEMIT("%s %u/%u", s->running ? "running" : "stopped", s->pos,
+		       s->nr);
+		mutex_unlock(&s->lock);
+		return 1;
+	}
+
+	if (argc == 2 && (!strcasecmp(argv[1], "stop") ||
+			  !strcasecmp(argv[1], "start") ||
+			  !strcasecmp(argv[1], "clear"))) {
+		dust_sched_stop(s);
+		mutex_lock(&s->lock);
+		if (!strcasecmp(argv[1], "start") && s->nr) {
+			s->pos = 0;
+			s->start = ktime_get();
+			s->running = true;
+			dust_sched_arm(s);
+		} else if (!strcasecmp(argv[1], "clear")) {
+			kvfree(s->ents);
+			s->ents = NULL;
+			s->nr = s->size = s->pos = 0;
+		}
+		mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	if (argc < 3) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	if (sscanf(argv[1], "%llu%c", &ms, &dummy) != 1 ||
+	    ms > U64_MAX / NSEC_PER_MSEC)
+		return -EINVAL;
+
+	if (strcasecmp(argv[2], "addbadrange") &&
+	    strcasecmp(argv[2], "removebadrange")) {
+		DMERR("unrecognized message '%s' received", argv[2]);
+		return -EINVAL;
+	}
+
+	r = dust_parse_range_cmd(dd, argc - 2, argv + 2, size, &cmd);
+	if (r)
+		return r;
+
+	mutex_lock(&s->lock);
+	if (s->running) {
+		r = -EBUSY;
+		goto out;
+	}
+	if (s->nr == DUST_SCHED_MAX_ENTRIES) {
+		DMERR("schedule is full");
+		r = -ENOSPC;
+		goto out;
+	}
+
+	if (s->nr == s->size) {
+		i = s->size ? s->size * 2 : 64;
+		ents = kvmalloc_array(i, sizeof(*ents), GFP_KERNEL);
+		if (ents == NULL) {
+			r = -ENOMEM;
+			goto out;
+		}
+		if (s->nr)
+			memcpy(ents, s->ents, s->nr * sizeof(*ents));
+		kvfree(s->ents);
+		s->ents = ents;
+		s->size = i;
+	}
+
+	for (i = s->nr; i && s->ents[i - 1].at_ns > ms * NSEC_PER_MSEC; i--)
+		;
+	memmove(&s->ents[i + 1], &s->ents[i], (s->nr - i) * sizeof(*s->ents));
+	s->ents[i].at_ns = ms * NSEC_PER_MSEC;
+	s->ents[i].cmd = cmd;
+	s->nr++;
+out:
+	mutex_unlock(&s->lock);
+
+	return r;
+}
+
+/*
+ * latency [enable|disable|reset]
+ *
+ * Time bios from dust_map() to completion, stop timing them, clear the
+ * histograms, or report them.
+ */
+static int dust_message_latency(struct dust_device *dd, unsigned int argc,
+				char **argv, char *result, unsigned int maxlen)
+{
+	if (argc == 1)
+		return dust_lat_emit(dd, result, maxlen);
+
+	if (argc != 2) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	if (!strcasecmp(argv[1], "enable"))
+		WRITE_ONCE(dd->lat_on, true);
+	else if (!strcasecmp(argv[1], "disable"))
+		WRITE_ONCE(dd->lat_on, false);
+	else if (!strcasecmp(argv[1], "reset"))
+		dust_lat_reset(dd);
+	else {
+		DMERR("unrecognized message '%s' received", argv[1]);
+		return -EINVAL;
 	}
 
-	return r;
+	return 0;
 }
 
-static int __dust_map_write(struct dust_device *dd, sector_t thisblock)
+/*
+ * snapshot <name>
+ * snapshot drop <name>
+ * snapshot list
+ * restore <name>
+ *
+ * Save a copy of the bad block list as name, drop a copy, list the
+ * copies with their extent counts, or replace the list with a copy.
+ * Failure modes enabled or disabled and counters are left alone.
+ */
+static int dust_message_snapshot(struct dust_device *dd, unsigned int argc,
+				 char **argv, char *result, unsigned int maxlen)
 {
-	struct badblock *bblk_r = dust_rb_search(&dd->badblocklist_read, thisblock);
-	struct badblock *bblk_w = dust_rb_search(&dd->badblocklist_write, thisblock);
+	struct dust_bblist *bbl = dd->bbl;
+	struct dust_snap *snap;
+	unsigned int sz = 0;
+	int r = 0;
 
-	if(dd->fail_write_on_bb) {
-		if (bblk_w) 
-			return DM_MAPIO_KILL;
+	if (!strcasecmp(argv[0], "restore")) {
+		if (argc != 2) {
+			DMERR("invalid number of arguments '%d'", argc);
+			return -EINVAL;
+		}
+		return dust_snap_restore(dd, argv[1]);
 	}
 
-	if(dd->fail_read_on_bb) {
-		if (bblk_r && bblk_r->wr_fail_cnt > 0) {
-			bblk_r->wr_fail_cnt--;
-			return DM_MAPIO_KILL;
-		}
+	if (argc == 2 && !strcasecmp(argv[1], "list")) {
+		mutex_lock(&bbl->snap_lock);
+		list_for_each_entry(snap, &bbl->snaps, list)
+			DMEMIT("%s%s:%lu", sz ? " " : "", snap->name, snap->nr);
+		mutex_unlock(&bbl->snap_lock);
+		return 1;
+	}
 
-		if (bblk_r) {
-			rb_erase(&bblk_r->node, &dd->badblocklist_read);
-			dd->badblock_count_read--;
-			kfree(bblk_r);
-			if (!dd->quiet_mode) {
-				sector_div(thisblock, dd->sect_per_block);
-				DMINFO("block %llu removed from badblocklist_read by write",
-		       			(unsigned long long)thisblock);
-			}
-		}
+	if (argc == 3 && !strcasecmp(argv[1], "drop")) {
+		mutex_lock(&bbl->snap_lock);
+		snap = dust_snap_find(bbl, argv[2]);
+		if (snap) {
+			list_del(&snap->list);
+			bbl->nr_snaps--;
+		} else
+			r = -ENOENT;
+		mutex_unlock(&bbl->snap_lock);
+		if (snap)
+			dust_snap_free(snap);
+		return r;
 	}
 
-	return DM_MAPIO_REMAPPED;
+	if (argc != 2) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
+
+	return dust_snap_take(dd, argv[1]);
 }
 
-static int dust_map_write(struct dust_device *dd, sector_t thisblock,
-			  bool fail_read_on_bb, bool fail_write_on_bb)
+static int dust_message_list(struct dust_device *dd, unsigned int argc,
+			     char **argv, char *result, unsigned int maxlen)
 {
-	unsigned long flags;
-	int ret = DM_MAPIO_REMAPPED;
+	unsigned long long start = 0, limit = ULLONG_MAX;
+	unsigned char flag;
+	char dummy;
 
-	if (fail_write_on_bb) {
-		thisblock >>= dd->sect_per_block_shift;
-		spin_lock_irqsave(&dd->dust_lock, flags);
-		ret = __dust_map_write(dd, thisblock);
-		spin_unlock_irqrestore(&dd->dust_lock, flags);
+	if (argc < 2 || argc > 4) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
 	}
-	else if (fail_read_on_bb) {
-		thisblock >>= dd->sect_per_block_shift;
-		spin_lock_irqsave(&dd->dust_lock, flags);
-		ret = __dust_map_write(dd, thisblock);
-		spin_unlock_irqrestore(&dd->dust_lock, flags);
+
+	if (!strcasecmp(argv[1], "read"))
+		flag = DUST_BB_READ;
+	else if (!strcasecmp(argv[1], "write"))
+		flag = DUST_BB_WRITE;
+	else if (!strcasecmp(argv[1], "slow"))
+		flag = DUST_BB_SLOW;
+	else if (!strcasecmp(argv[1], "corrupt"))
+		flag = DUST_BB_CORRUPT;
+	else {
+		DMERR("unrecognized message '%s' received", argv[0]);
+		return -EINVAL;
 	}
 
-	return ret;
+	if ((argc > 2 && sscanf(argv[2], "%llu%c", &start, &dummy) != 1) ||
+	    (argc > 3 && (sscanf(argv[3], "%llu%c", &limit, &dummy) != 1 ||
+			  !limit)))
+		return -EINVAL;
+
+	return dust_list_badblocks(dd, flag, start, limit, result, maxlen);
 }
 
-static int dust_map(struct dm_target *ti, struct bio *bio)
+/*
+ * setdelay <delay_us> [<jitter_us>]
+ *
+ * The delay every bio waits for while delays are enabled, and the upper
+ * bound of the random jitter added to each delayed bio.
+ */
+static int dust_message_delay(struct dust_device *dd, unsigned int argc,
+			      char **argv)
 {
-	struct dust_device *dd = ti->private;
-	int r;
+	unsigned int delay_us, jitter_us = 0;
+	char dummy;
 
-	bio_set_dev(bio, dd->dev->bdev);
-	bio->bi_iter.bi_sector = dd->start + dm_target_offset(ti, bio->bi_iter.bi_sector);
+	if (argc != 2 && argc != 3) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
+	}
 
-	if (bio_data_dir(bio) == READ)
-		r = dust_map_read(dd, bio->bi_iter.bi_sector, dd->fail_read_on_bb);
-	else
-		r = dust_map_write(dd, bio->bi_iter.bi_sector, dd->fail_read_on_bb, dd->fail_write_on_bb);
+	if (sscanf(argv[1], "%u%c", &delay_us, &dummy) != 1 ||
+	    (argc == 3 && sscanf(argv[2], "%u%c", &jitter_us, &dummy) != 1))
+		return -EINVAL;
 
-	return r;
+	if (delay_us > DUST_DELAY_MAX_US || jitter_us > DUST_DELAY_MAX_US) {
+		DMERR("selected delay out of range");
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(dd->delay_us, delay_us);
+	WRITE_ONCE(dd->delay_jitter_us, jitter_us);
+	if (!dd->quiet_mode)
+		DMINFO("%s: delay set to %uus with jitter %uus", __func__,
+		       delay_us, jitter_us);
+
+	return 0;
 }
 
-static bool __dust_clear_badblocks(struct rb_root *tree,
-				   unsigned long long count)
+/*
+ * setcorrupt <offset> <xor>
+ *
+ * Reads of corrupt blocks get the byte at offset in each block XORed
+ * with xor, 1 to 255.  The default flips the lowest bit of the first
+ * byte.
+ */
+static int dust_message_corrupt(struct dust_device *dd, unsigned int argc,
+				char **argv)
 {
-	struct rb_node *node = NULL, *nnode = NULL;
+	unsigned int offset;
+	char dummy;
+	int xor;
 
-	nnode = rb_first(tree);
-	if (nnode == NULL) {
-		BUG_ON(count != 0);
-		return false;
+	if (argc != 3) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
 	}
 
-	while (nnode) {
-		node = nnode;
-		nnode = rb_next(node);
-		rb_erase(node, tree);
-		count--;
-		kfree(node);
+	if (sscanf(argv[1], "%u%c", &offset, &dummy) != 1 ||
+	    sscanf(argv[2], "%i%c", &xor, &dummy) != 1)
+		return -EINVAL;
+
+	if (offset >= dd->blksz || xor < 1 || xor > 255) {
+		DMERR("selected corruption out of range");
+		return -EINVAL;
 	}
-	BUG_ON(count != 0);
-	BUG_ON(tree->rb_node != NULL);
 
-	return true;
+	WRITE_ONCE(dd->corrupt_offset, offset);
+	WRITE_ONCE(dd->corrupt_xor, xor);
+	if (!dd->quiet_mode)
+		DMINFO("%s: byte %u of corrupt blocks XORed with 0x%02x",
+		       __func__, offset, xor);
+
+	return 0;
 }
 
-static int dust_clear_badblocks(struct dust_device *dd, bool mode)
+/*
+ * seterror <ioerr|medium|timeout|target>
+ *
+ * The status bios failed from now on complete with.
+ */
+static int dust_message_error(struct dust_device *dd, unsigned int argc,
+			      char **argv)
 {
-	unsigned long flags;
-	struct rb_root badblocklist_read;
-	struct rb_root badblocklist_write;
-	unsigned long long badblock_count_read;
-	unsigned long long badblock_count_write;
+	blk_status_t status;
 
-	spin_lock_irqsave(&dd->dust_lock, flags);
-	if(mode == RD) {
-		badblocklist_read = dd->badblocklist_read;
-		badblock_count_read = dd->badblock_count_read;
-		dd->badblocklist_read = RB_ROOT;
-		dd->badblock_count_read = 0;
-	}
-	else {
-		badblocklist_write = dd->badblocklist_write;
-		badblock_count_write = dd->badblock_count_write;
-		dd->badblocklist_write = RB_ROOT;
-		dd->badblock_count_write = 0;
+	if (argc != 2) {
+		DMERR("invalid number of arguments '%d'", argc);
+		return -EINVAL;
 	}
-	spin_unlock_irqrestore(&dd->dust_lock, flags);
 
-	if(mode == RD) {
-		if (!__dust_clear_badblocks(&badblocklist_read, badblock_count_read))
-			DMINFO("%s: no read badblocks found", __func__);
-		else
-			DMINFO("%s: read badblocks cleared", __func__);
-	}
-	else {
-		if (!__dust_clear_badblocks(&badblocklist_write, badblock_count_write))
-			DMINFO("%s: no write badblocks found", __func__);
-		else
-			DMINFO("%s: write badblocks cleared", __func__);
+	if (dust_parse_error_status(argv[1], &status)) {
+		DMERR("invalid error status '%s'", argv[1]);
+		return -EINVAL;
 	}
 
+	WRITE_ONCE(dd->error_status, status);
+	if (!dd->quiet_mode)
+		DMINFO("%s: failed bios complete with %s", __func__,
+		       dust_error_status_name(status));
+
 	return 0;
 }
 
 /*
- * Target parameters:
- *
- * <device_path> <offset> <blksz>
+ * setfailrate <read|write> <numerator> <denominator> [io]
+ * setseed <seed>
  *
- * device_path: path to the block device
- * offset: offset to data area from start of device_path
- * blksz: block size (minimum 512, maximum 1073741824, must be a power of 2)
+ * Blocks fail in the given mode with probability numerator/denominator
+ * while failures in that mode are enabled; 0 turns random failures off.
+ * With io every bio is drawn for separately.
  */
-static int dust_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+static int dust_message_rate(struct dust_device *dd, unsigned int argc,
+			     char **argv)
 {
-	struct dust_device *dd;
-	unsigned long long tmp;
+	unsigned long long num, den;
+	u64 threshold;
 	char dummy;
-	unsigned int blksz;
-	unsigned int sect_per_block;
-	sector_t DUST_MAX_BLKSZ_SECTORS = 2097152;
-	sector_t max_block_sectors = min(ti->len, DUST_MAX_BLKSZ_SECTORS);
+	bool mode;
 
-	if (argc != 3) {
-		ti->error = "Invalid argument count";
-		return -EINVAL;
+	if (!strcasecmp(argv[0], "setseed")) {
+		if (argc != 2) {
+			DMERR("invalid number of arguments '%d'", argc);
+			return -EINVAL;
+		}
+		if (sscanf(argv[1], "%llu%c", &num, &dummy) != 1)
+			return -EINVAL;
+		dust_rate_seed(dd, num);
+		return 0;
 	}
 
-	if (kstrtouint(argv[2], 10, &blksz) || !blksz) {
-		ti->error = "Invalid block size parameter";
+	if (argc != 5 && argc != 4) {
+		DMERR("invalid number of arguments '%d'", argc);
 		return -EINVAL;
 	}
 
-	if (blksz < 512) {
-		ti->error = "Block size must be at least 512";
+	if (!strcasecmp(argv[1], "read"))
+		mode = RD;
+	else if (!strcasecmp(argv[1], "write"))
+		mode = WR;
+	else {
+		DMERR("unrecognized message '%s' received", argv[0]);
 		return -EINVAL;
 	}
 
-	if (!is_power_of_2(blksz)) {
-		ti->error = "Block size must be a power of 2";
+	if (sscanf(argv[2], "%llu%c", &num, &dummy) != 1 ||
+	    sscanf(argv[3], "%llu%c", &den, &dummy) != 1 ||
+	    (argc == 5 && strcasecmp(argv[4], "io")))
 		return -EINVAL;
-	}
 
-	if (to_sector(blksz) > max_block_sectors) {
-		ti->error = "Block size is too large";
+	if (!den || num > den || num > U32_MAX) {
+		DMERR("selected failure rate out of range");
 		return -EINVAL;
 	}
 
-	sect_per_block = (blksz >> SECTOR_SHIFT);
+	threshold = div64_u64(num << 32, den);
+	WRITE_ONCE(dd->fail_rate[mode].per_io, argc == 5);
+	WRITE_ONCE(dd->fail_rate[mode].threshold, threshold);
+	if (!dd->quiet_mode)
+		DMINFO("%s: %s failure rate set to %llu/%llu%s", __func__,
+		       argv[1], num, den, argc == 5 ? " per bio" : "");
 
-	if (sscanf(argv[1], "%llu%c", &tmp, &dummy) != 1 || tmp != (sector_t)tmp) {
-		ti->error = "Invalid device offset sector";
-		return -EINVAL;
-	}
+	return 0;
+}
 
-	dd = kzalloc(sizeof(struct dust_device), GFP_KERNEL);
-	if (dd == NULL) {
-		ti->error = "Cannot allocate context";
-		return -ENOMEM;
-	}
+/*
+ * addbadblocks <read|write> <block|first-last>...
+ * removebadblocks <read|write> <block|first-last>...
+ * loadbadblocks <read|write> <path>
+ */
+static int dust_message_bulk(struct dust_device *dd, unsigned int argc,
+			     char **argv, sector_t size)
+{
+	struct dust_bb_op op = { 0 };
+	struct dust_range *ranges = NULL;
+	unsigned long long first, last;
+	unsigned int i, nr = 0;
+	char dummy;
+	int r;
 
-	if (dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &dd->dev)) {
-		ti->error = "Device lookup failed";
-		kfree(dd);
+	if (argc < 3 || (!strcasecmp(argv[0], "loadbadblocks") && argc != 3)) {
+		DMERR("invalid number of arguments '%d'", argc);
 		return -EINVAL;
 	}
 
-	dd->sect_per_block = sect_per_block;
-	dd->blksz = blksz;
-	dd->start = tmp;
-
-	dd->sect_per_block_shift = __ffs(sect_per_block);
-
-	/*
-	 * Whether to fail a read on a "bad" block.
-	 * Defaults to false; enabled later by message.
-	 */
-	dd->fail_read_on_bb = false;
-
-	/*
-	 * Fail a write on a "bad" block.
-	 * Defaults to false; enabled later by message.
-	 */
-	dd->fail_write_on_bb = false;
+	if (!strcasecmp(argv[1], "read"))
+		op.set = DUST_BB_READ;
+	else if (!strcasecmp(argv[1], "write"))
+		op.set = DUST_BB_WRITE;
+	else {
+		DMERR("unrecognized message '%s' received", argv[0]);
+		return -EINVAL;
+	}
 
-	/*
-	 * Initialize bad block list rbtree.
-	 */
-	dd->badblocklist_read = RB_ROOT;
-	dd->badblock_count_read = 0;
-	dd->badblocklist_write = RB_ROOT;
-	dd->badblock_count_write = 0;
-	spin_lock_init(&dd->dust_lock);
+	if (!strcasecmp(argv[0], "removebadblocks")) {
+		op.clear = op.set;
+		op.set = 0;
+	} else
+		op.set_cnt = op.set == DUST_BB_READ;
 
-	dd->quiet_mode = false;
+	sector_div(size, dd->sect_per_block);
 
-	BUG_ON(dm_set_target_max_io_len(ti, dd->sect_per_block) != 0);
+	if (!strcasecmp(argv[0], "loadbadblocks")) {
+		r = dust_load_ranges(argv[2], size, &ranges, &nr);
+		if (r)
+			return r;
+	} else {
+		ranges = kvmalloc_array(argc - 2, sizeof(*ranges), GFP_KERNEL);
+		if (ranges == NULL)
+			return -ENOMEM;
 
-	ti->num_discard_bios = 1;
-	ti->num_flush_bios = 1;
-	ti->private = dd;
+		for (i = 2; i < argc; i++, nr++) {
+			if (sscanf(argv[i], "%llu-%llu%c", &first, &last,
+				   &dummy) != 2) {
+				if (sscanf(argv[i], "%llu%c", &first,
+					   &dummy) != 1) {
+					DMERR("invalid block '%s'", argv[i]);
+					r = -EINVAL;
+					goto out;
+				}
+				last = first;
+			}
 
-	return 0;
-}
+			if (first > last || last > size) {
+				DMERR("selected block range out of range");
+				r = -EINVAL;
+				goto out;
+			}
+			ranges[nr].first = first;
+			ranges[nr].last = last;
+		}
+	}
 
-static void dust_dtr(struct dm_target *ti)
-{
-	struct dust_device *dd = ti->private;
+	nr = dust_ranges_normalize(ranges, nr);
+	r = dust_bb_bulk(dd, ranges, nr, &op);
+	if (!r && !dd->quiet_mode)
+		DMINFO("%s: %u %s badblock range(s) %s", __func__, nr, argv[1],
+		       op.set ? "added" : "removed");
+out:
+	kvfree(ranges);
 
-	__dust_clear_badblocks(&dd->badblocklist_read, dd->badblock_count_read);
-	__dust_clear_badblocks(&dd->badblocklist_write, dd->badblock_count_write);
-	dm_put_device(ti, dd->dev);
-	kfree(dd);
+	return r;
 }
 
-static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
-			char *result_buf, unsigned int maxlen)
+static int __dust_message(struct dm_target *ti, unsigned int argc, char **argv,
+			  char *result_buf, unsigned int maxlen)
 {
 	struct dust_device *dd = ti->private;
 	sector_t size = i_size_read(dd->dev->bdev->bd_inode) >> SECTOR_SHIFT;
 	bool invalid_msg = false;
 	int r = -EINVAL;
 	unsigned long long tmp, block;
-	unsigned char wr_fail_cnt;
+	unsigned int wr_fail_cnt;
 	unsigned int tmp_ui;
-	unsigned long flags;
 	char dummy;
 
+	if (!strcasecmp(argv[0], "listbadblocks"))
+		return dust_message_list(dd, argc, argv, result_buf, maxlen);
+
+	if (!strcasecmp(argv[0], "addbadrange") ||
+	    !strcasecmp(argv[0], "removebadrange"))
+		return dust_message_range(dd, argc, argv, size);
+
+	if (!strcasecmp(argv[0], "setdelay"))
+		return dust_message_delay(dd, argc, argv);
+
+	if (!strcasecmp(argv[0], "seterror"))
+		return dust_message_error(dd, argc, argv);
+
+	if (!strcasecmp(argv[0], "setcorrupt"))
+		return dust_message_corrupt(dd, argc, argv);
+
+	if (!strcasecmp(argv[0], "schedule"))
+		return dust_message_schedule(dd, argc, argv, size, result_buf,
+					     maxlen);
+
+	if (!strcasecmp(argv[0], "latency"))
+		return dust_message_latency(dd, argc, argv, result_buf, maxlen);
+
+	if (!strcasecmp(argv[0], "snapshot") ||
+	    !strcasecmp(argv[0], "restore"))
+		return dust_message_snapshot(dd, argc, argv, result_buf,
+					     maxlen);
+
+	if (!strcasecmp(argv[0], "trigger"))
+		return dust_message_trigger(dd, argc, argv, size, result_buf,
+					    maxlen);
+
+	if (!strcasecmp(argv[0], "benchmark"))
+		return dust_message_benchmark(dd, argc, argv, size, result_buf,
+					      maxlen);
+
+	if (!strcasecmp(argv[0], "setfailrate") ||
+	    !strcasecmp(argv[0], "setseed"))
+		return dust_message_rate(dd, argc, argv);
+
+	if (!strcasecmp(argv[0], "addbadblocks") ||
+	    !strcasecmp(argv[0], "removebadblocks") ||
+	    !strcasecmp(argv[0], "loadbadblocks"))
+		return dust_message_bulk(dd, argc, argv, size);
+
 	if (argc == 1) {
 		if (!strcasecmp(argv[0], "addbadblock") ||
 		    !strcasecmp(argv[0], "removebadblock") ||
@@ -502,6 +6033,14 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 			DMERR("%s requires 1 additional argument", argv[0]);
 		} else if (!strcasecmp(argv[0], "clearbadblocks")) {
 			DMERR("%s requires 1 additional argument", argv[0]);
+		} else if (!strcasecmp(argv[0], "stats")) {
+			dust_stats_emit(dd, result_buf, 0, maxlen);
+			r = 1;
+		} else if (!strcasecmp(argv[0], "events")) {
+			r = dust_events_emit(dd, result_buf, maxlen);
+		} else if (!strcasecmp(argv[0], "resetstats")) {
+			dust_stats_reset(dd);
+			r = 0;
 		} else if (!strcasecmp(argv[0], "quiet")) {
 			if (!dd->quiet_mode)
 				dd->quiet_mode = true;
@@ -523,13 +6062,28 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 		else if (!strcasecmp(argv[0], "enable")) {
 			if (!strcasecmp(argv[1], "read")) {
 				DMINFO("enabling read failures on bad sectors");
-				dd->fail_read_on_bb = true;
+				dust_set_fail_mode(dd, &dd->fail_read_on_bb,
+						   true);
 				r = 0;
 				invalid_msg = false;
 			}
 			else if (!strcasecmp(argv[1], "write")) {
 				DMINFO("enabling write failures on bad sectors");
-				dd->fail_write_on_bb = true;
+				dust_set_fail_mode(dd, &dd->fail_write_on_bb,
+						   true);
+				r = 0;
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "slow")) {
+				DMINFO("enabling delays on slow sectors");
+				dust_set_fail_mode(dd, &dd->delay_on_bb, true);
+				r = 0;
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "corrupt")) {
+				DMINFO("enabling corruption on corrupt sectors");
+				dust_set_fail_mode(dd, &dd->corrupt_on_bb,
+						   true);
 				r = 0;
 				invalid_msg = false;
 			}
@@ -539,13 +6093,28 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 		else if (!strcasecmp(argv[0], "disable")) {
 			if (!strcasecmp(argv[1], "read")) {
 				DMINFO("disabling read failures on bad sectors");
-				dd->fail_read_on_bb = false;
+				dust_set_fail_mode(dd, &dd->fail_read_on_bb,
+						   false);
 				r = 0;
 				invalid_msg = false;
 			}
 			else if (!strcasecmp(argv[1], "write")) {
 				DMINFO("disabling write failures on bad sectors");
-				dd->fail_write_on_bb = false;
+				dust_set_fail_mode(dd, &dd->fail_write_on_bb,
+						   false);
+				r = 0;
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "slow")) {
+				DMINFO("disabling delays on slow sectors");
+				dust_set_fail_mode(dd, &dd->delay_on_bb, false);
+				r = 0;
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "corrupt")) {
+				DMINFO("disabling corruption on corrupt sectors");
+				dust_set_fail_mode(dd, &dd->corrupt_on_bb,
+						   false);
 				r = 0;
 				invalid_msg = false;
 			}
@@ -570,11 +6139,19 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 		}
 		else if (!strcasecmp(argv[0], "clearbadblocks")) {
 			if (!strcasecmp(argv[1], "read")) {
-				r = dust_clear_badblocks(dd,false);
+				r = dust_clear_badblocks(dd, DUST_BB_READ);
 				invalid_msg = false;
 			}
 			else if (!strcasecmp(argv[1], "write")) {
-				r = dust_clear_badblocks(dd,true);
+				r = dust_clear_badblocks(dd, DUST_BB_WRITE);
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "slow")) {
+				r = dust_clear_badblocks(dd, DUST_BB_SLOW);
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "corrupt")) {
+				r = dust_clear_badblocks(dd, DUST_BB_CORRUPT);
 				invalid_msg = false;
 			}
 			else
@@ -582,19 +6159,23 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 		}
 		else if (!strcasecmp(argv[0], "countbadblocks")) {
 			if (!strcasecmp(argv[1], "read")) {
-				spin_lock_irqsave(&dd->dust_lock, flags);
-				DMINFO("countbadblocks: %llu read badblock(s) found",
-			       		dd->badblock_count_read);
-				spin_unlock_irqrestore(&dd->dust_lock, flags);
-				r = 0;
+				r = dust_count_badblocks(dd, DUST_BB_READ,
+							 result_buf, maxlen);
 				invalid_msg = false;
 			}
 			else if (!strcasecmp(argv[1], "write")) {
-				spin_lock_irqsave(&dd->dust_lock, flags);
-				DMINFO("countbadblocks: %llu write badblock(s) found",
-			       		dd->badblock_count_write);
-				spin_unlock_irqrestore(&dd->dust_lock, flags);
-				r = 0;
+				r = dust_count_badblocks(dd, DUST_BB_WRITE,
+							 result_buf, maxlen);
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "slow")) {
+				r = dust_count_badblocks(dd, DUST_BB_SLOW,
+							 result_buf, maxlen);
+				invalid_msg = false;
+			}
+			else if (!strcasecmp(argv[1], "corrupt")) {
+				r = dust_count_badblocks(dd, DUST_BB_CORRUPT,
+							 result_buf, maxlen);
 				invalid_msg = false;
 			}
 			else
@@ -639,11 +6220,13 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 		}
 		else if (!strcasecmp(argv[0], "queryblock")) {
 			if (!strcasecmp(argv[1], "read")) {
-				r = dust_query_block(dd, block, false);
+				r = dust_query_block(dd, block, false,
+						     result_buf, maxlen);
 				invalid_msg = false;
 			}
 			else if (!strcasecmp(argv[1], "write")) {
-				r = dust_query_block(dd, block, true);
+				r = dust_query_block(dd, block, true,
+						     result_buf, maxlen);
 				invalid_msg = false;
 			}
 			else
@@ -659,7 +6242,7 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
                         return r;
 
                 block = tmp;
-                if (tmp_ui > 255) {
+                if (tmp_ui > DUST_MAX_WR_FAIL_CNT) {
                         DMERR("selected write fail count out of range");
                         return r;
                 }
@@ -693,11 +6276,39 @@ static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
 	return r;
 }
 
+/*
+ * With a metadata device, messages are serialized so that the journal
+ * records updates in the order they were applied.
+ */
+static int dust_message(struct dm_target *ti, unsigned int argc, char **argv,
+			char *result_buf, unsigned int maxlen)
+{
+	struct dust_device *dd = ti->private;
+	int r;
+
+	if (dd->md == NULL) {
+		if (!strcasecmp(argv[0], "commitmetadata")) {
+			DMERR("no metadata device");
+			return -EINVAL;
+		}
+		return __dust_message(ti, argc, argv, result_buf, maxlen);
+	}
+
+	mutex_lock(&dd->md->lock);
+	if (!strcasecmp(argv[0], "commitmetadata"))
+		r = argc == 1 ? dust_md_commit(dd) : -EINVAL;
+	else
+		r = __dust_message(ti, argc, argv, result_buf, maxlen);
+	mutex_unlock(&dd->md->lock);
+
+	return r;
+}
+
 static void dust_status(struct dm_target *ti, status_type_t type,
 			unsigned int status_flags, char *result, unsigned int maxlen)
 {
 	struct dust_device *dd = ti->private;
-	unsigned int sz = 0;
+	unsigned int sz = 0, nr;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
@@ -707,11 +6318,43 @@ static void dust_status(struct dm_target *ti, status_type_t type,
 		DMEMIT("\n%s %s %s", dd->dev->name,
 		       dd->fail_write_on_bb ? "fail_write_on_bad_block" : "bypass",
 		       dd->quiet_mode ? "quiet" : "verbose");
+		DMEMIT("\n%s %s %s", dd->dev->name,
+		       dd->delay_on_bb ? "delay_on_slow_block" : "bypass",
+		       dd->quiet_mode ? "quiet" : "verbose");
+		DMEMIT("\n%s %s %s", dd->dev->name,
+		       dd->corrupt_on_bb ? "corrupt_on_corrupt_block" :
+					   "bypass",
+		       dd->quiet_mode ? "quiet" : "verbose");
+		DMEMIT("\n%s ", dd->dev->name);
+		sz = dust_stats_emit(dd, result, sz, maxlen);
 		break;
 
 	case STATUSTYPE_TABLE:
 		DMEMIT("%s %llu %u", dd->dev->name,
 		       (unsigned long long)dd->start, dd->blksz);
+		nr = (dd->bbl->index == DUST_INDEX_ARRAY ? 2 : 0) +
+		     (dd->md ? 2 : 0) + (dd->bbl->nr_shards > 1 ? 2 : 0) +
+		     (dd->error_status != BLK_STS_IOERR ? 2 : 0) +
+		     (dd->discard != DUST_DISCARD_HEAL ? 2 : 0) +
+		     (*dd->bbl->name ? 2 : 0) + (dd->bb ? 1 : 0);
+		if (nr)
+			DMEMIT(" %u", nr);
+		if (dd->bbl->index == DUST_INDEX_ARRAY)
+			DMEMIT(" index array");
+		if (dd->md)
+			DMEMIT(" metadata %s", dd->md->dev->name);
+		if (dd->bbl->nr_shards > 1)
+			DMEMIT(" shards %u", dd->bbl->nr_shards);
+		if (dd->error_status != BLK_STS_IOERR)
+			DMEMIT(" error %s",
+			       dust_error_status_name(dd->error_status));
+		if (dd->discard != DUST_DISCARD_HEAL)
+			DMEMIT(" discard %s", dd->discard == DUST_DISCARD_FAIL ?
+			       "fail" : "ignore");
+		if (*dd->bbl->name)
+			DMEMIT(" share %s", dd->bbl->name);
+		if (dd->bb)
+			DMEMIT(" badblocks");
 		break;
 	}
 }
@@ -743,12 +6386,16 @@ static int dust_iterate_devices(struct dm_target *ti, iterate_devices_callout_fn
 
 static struct target_type dust_target = {
 	.name = "dust",
-	.version = {1, 0, 0},
+	.version = {1, 1, 0},
 	.module = THIS_MODULE,
 	.ctr = dust_ctr,
 	.dtr = dust_dtr,
 	.iterate_devices = dust_iterate_devices,
 	.map = dust_map,
+	.end_io = dust_end_io,
+	.presuspend = dust_presuspend,
+	.postsuspend = dust_postsuspend,
+	.resume = dust_resume,
 	.message = dust_message,
 	.status = dust_status,
 	.prepare_ioctl = dust_prepare_ioctl,
@@ -756,10 +6403,51 @@ static struct target_type dust_target = {
 
 static int __init dm_dust_init(void)
 {
-	int r = dm_register_target(&dust_target);
+	int r;
+
+	dust_wq = alloc_workqueue("kdustd", WQ_UNBOUND, 0);
+	if (!dust_wq)
+		return -ENOMEM;
+
+	dust_delay_wq = alloc_workqueue("kdustd_delay",
+					WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!dust_delay_wq) {
+		r = -ENOMEM;
+		goto bad_delay_wq;
+	}
+
+	badblock_cache = kmem_cache_create("dm_dust_badblock",
+					   sizeof(struct badblock),
+					   __alignof__(struct badblock), 0,
+					   NULL);
+	if (!badblock_cache) {
+		r = -ENOMEM;
+		goto bad_cache;
+	}
+
+	badblock_pool = mempool_create_slab_pool(DUST_BB_POOL_SIZE,
+						 badblock_cache);
+	if (!badblock_pool) {
+		r = -ENOMEM;
+		goto bad_pool;
+	}
 
-	if (r < 0)
+	r = dm_register_target(&dust_target);
+	if (r < 0) {
 		DMERR("dm_register_target failed %d", r);
+		goto bad_register;
+	}
+
+	return 0;
+
+bad_register:
+	mempool_destroy(badblock_pool);
+bad_pool:
+	kmem_cache_destroy(badblock_cache);
+bad_cache:
+	destroy_workqueue(dust_delay_wq);
+bad_delay_wq:
+	destroy_workqueue(dust_wq);
 
 	return r;
 }
@@ -767,6 +6455,15 @@ static int __init dm_dust_init(void)
 static void __exit dm_dust_exit(void)
 {
 	dm_unregister_target(&dust_target);
+
+	/*
+	 * Wait for the trees and extents still queued for freeing.
+	 */
+	destroy_workqueue(dust_delay_wq);
+	destroy_workqueue(dust_wq);
+	rcu_barrier();
+	mempool_destroy(badblock_pool);
+	kmem_cache_destroy(badblock_cache);
 }
 
 module_init(dm_dust_init);